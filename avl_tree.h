@@ -33,8 +33,544 @@
 // http://www.cmcrossroads.com/bradapp/ftp/src/libs/C++/AvlTrees.html
 // See LICENSE_AvlTrees.txt
 
-template <class KeyType, class ValueType> class AVLTree {
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <limits>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__GNUC__)
+#define AVL_TREE_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define AVL_TREE_PREFETCH(p)
+#endif
+
+// Allocates objects of type T one at a time from contiguous chunks.
+// Freed objects are kept on a free list and reused by later allocations,
+// and every chunk is returned at once by ReleaseAll().
+template <class T> class AVLPoolAllocator {
+ public:
+  // ReleaseAll() frees every object, so the owner may skip per-object frees.
+  static const bool kBulkRelease = true;
+
+  AVLPoolAllocator() :
+      chunks_(NULL),
+      free_list_(NULL),
+      next_slot_(0),
+      chunk_capacity_(0) {
+  }
+
+  ~AVLPoolAllocator() {
+    ReleaseAll();
+  }
+
+  void* Allocate() {
+    if (free_list_) {
+      Slot* slot = free_list_;
+      free_list_ = slot->next;
+      return slot;
+    }
+    if (chunks_ == NULL || next_slot_ == chunk_capacity_) {
+      AddChunk();
+    }
+    return &chunks_->Slots()[next_slot_++];
+  }
+
+  // Returns contiguous storage for n objects laid out as T[n]. Each of
+  // them may later be passed to Free() on its own.
+  void* AllocateArray(size_t n) {
+    static_assert(sizeof(T) == sizeof(Slot),
+                  "array elements must be usable as free list slots");
+    Chunk* chunk = static_cast<Chunk*>(
+        ::operator new(sizeof(Slot) * (n + 1)));
+    if (chunks_) {
+      // Keep the partially used chunk at the head.
+      chunk->next = chunks_->next;
+      chunks_->next = chunk;
+    } else {
+      chunk->next = NULL;
+      chunks_ = chunk;
+      chunk_capacity_ = next_slot_ = 0;
+    }
+    return chunk->Slots();
+  }
+
+  void Free(void* p) {
+    Slot* slot = static_cast<Slot*>(p);
+    slot->next = free_list_;
+    free_list_ = slot;
+  }
+
+  // Takes over every chunk of other, so that objects allocated from it
+  // may be freed here and live as long as this pool. other is left empty.
+  void Absorb(AVLPoolAllocator* other) {
+    if (other->chunks_ == NULL) {
+      return;
+    }
+    // Slots other has not handed out yet are not lost with its cursor.
+    while (other->next_slot_ < other->chunk_capacity_) {
+      other->Free(&other->chunks_->Slots()[other->next_slot_++]);
+    }
+    Chunk* last = other->chunks_;
+    while (last->next) {
+      last = last->next;
+    }
+    if (chunks_) {
+      // Keep the partially used chunk at the head.
+      last->next = chunks_->next;
+      chunks_->next = other->chunks_;
+    } else {
+      chunks_ = other->chunks_;
+      chunk_capacity_ = next_slot_ = 0;
+    }
+    if (other->free_list_) {
+      Slot* tail = other->free_list_;
+      while (tail->next) {
+        tail = tail->next;
+      }
+      tail->next = free_list_;
+      free_list_ = other->free_list_;
+    }
+    other->chunks_ = NULL;
+    other->free_list_ = NULL;
+    other->next_slot_ = 0;
+    other->chunk_capacity_ = 0;
+  }
+
+  void ReleaseAll() {
+    while (chunks_) {
+      Chunk* next = chunks_->next;
+      ::operator delete(chunks_);
+      chunks_ = next;
+    }
+    free_list_ = NULL;
+    next_slot_ = 0;
+    chunk_capacity_ = 0;
+  }
+
+ private:
+  enum {
+    kFirstChunkCapacity = 32,
+    kMaxChunkCapacity = 4096
+  };
+
+  union Slot {
+    Slot* next;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+  };
+
+  struct Chunk {
+    Chunk* next;
+
+    Slot* Slots() {
+      return reinterpret_cast<Slot*>(this) + 1;
+    }
+  };
+
+  void AddChunk() {
+    size_t capacity = chunk_capacity_ ? chunk_capacity_ * 2
+        : static_cast<size_t>(kFirstChunkCapacity);
+    if (capacity > kMaxChunkCapacity) {
+      capacity = kMaxChunkCapacity;
+    }
+    // Header is padded to a whole slot so that the slots stay aligned.
+    Chunk* chunk = static_cast<Chunk*>(
+        ::operator new(sizeof(Slot) * (capacity + 1)));
+    chunk->next = chunks_;
+    chunks_ = chunk;
+    chunk_capacity_ = capacity;
+    next_slot_ = 0;
+  }
+
+  Chunk* chunks_;
+  Slot* free_list_;
+  size_t next_slot_;
+  size_t chunk_capacity_;
+
+  AVLPoolAllocator(const AVLPoolAllocator&);
+  AVLPoolAllocator& operator=(const AVLPoolAllocator&);
+};
+
+// Allocates every object separately with operator new.
+template <class T> class AVLHeapAllocator {
+ public:
+  static const bool kBulkRelease = false;
+
+  void* Allocate() {
+    return ::operator new(sizeof(T));
+  }
+
+  // Objects are freed one by one, so arrays are not supported.
+  void* AllocateArray(size_t) {
+    return NULL;
+  }
+
+  void Free(void* p) {
+    ::operator delete(p);
+  }
+
+  void Absorb(AVLHeapAllocator*) {
+  }
+
+  void ReleaseAll() {
+  }
+};
+
+// Node mixin that records how many nodes are in each subtree. It makes
+// Rank(), Select() and CountInRange() available at one word per node.
+class AVLSubtreeSize {
+ public:
+  static const bool kEnabled = true;
+
+  AVLSubtreeSize() : subtree_size_(1) {}
+
+  size_t SubtreeSize() const {
+    return subtree_size_;
+  }
+
+  void SetSubtreeSize(size_t size) {
+    subtree_size_ = size;
+  }
+
+ private:
+  size_t subtree_size_;
+};
+
+// Default node mixin: no per-node counts and no order statistics.
+class AVLNoSubtreeSize {
+ public:
+  static const bool kEnabled = false;
+
+  size_t SubtreeSize() const {
+    return 0;
+  }
+
+  void SetSubtreeSize(size_t) {
+  }
+};
+
+// Default AggregatePolicy: nodes keep no summary and Aggregate() is not
+// available.
+struct AVLNoAggregate {
+  static const bool kEnabled = false;
+  typedef void Type;
+};
+
+// AggregatePolicy summing values. An AggregatePolicy is a monoid: Type,
+// Identity(), Of(value), which lifts a value into Type, and Combine(a, b),
+// which must be associative but need not be commutative; a is always the
+// summary of the smaller keys. A policy that summarizes keys as well
+// defines Of(key, value) instead. Validate() compares summaries with ==.
+template <class T> struct AVLSum {
+  static const bool kEnabled = true;
+  typedef T Type;
+
+  static T Identity() {
+    return T();
+  }
+
+  static T Of(const T& value) {
+    return value;
+  }
+
+  static T Combine(const T& a, const T& b) {
+    return a + b;
+  }
+};
+
+// AggregatePolicy for the smallest value; empty ranges give the largest T.
+template <class T> struct AVLMin {
+  static const bool kEnabled = true;
+  typedef T Type;
+
+  static T Identity() {
+    return std::numeric_limits<T>::max();
+  }
+
+  static T Of(const T& value) {
+    return value;
+  }
+
+  static T Combine(const T& a, const T& b) {
+    return (b < a) ? b : a;
+  }
+};
+
+// AggregatePolicy for the largest value; empty ranges give the lowest T.
+template <class T> struct AVLMax {
+  static const bool kEnabled = true;
+  typedef T Type;
+
+  static T Identity() {
+    return std::numeric_limits<T>::lowest();
+  }
+
+  static T Of(const T& value) {
+    return value;
+  }
+
+  static T Combine(const T& a, const T& b) {
+    return (a < b) ? b : a;
+  }
+};
+
+// Node mixin that caches the AggregatePolicy summary of the node's
+// subtree, refreshed wherever subtree sizes are.
+template <class AggregatePolicy> class AVLAggregateNode {
+ public:
+  typedef typename AggregatePolicy::Type Type;
+
+  const Type& SubtreeAggregate() const {
+    return aggregate_;
+  }
+
+  // The summary of n's item alone.
+  template <class Item>
+  static Type Lift(const Item* n) {
+    return Lift(n, UseKey());
+  }
+
+  // Recomputes the summary of the subtree at n, which is this node, from
+  // its item and its children's summaries.
+  template <class Node>
+  void UpdateAggregate(const Node* n) {
+    aggregate_ = Summarize(n);
+  }
+
+  // Whether the cached summary of n, which is this node, matches its item
+  // and its children's cached summaries. Used by Validate().
+  template <class Node>
+  bool AggregateIsCurrent(const Node* n) const {
+    return Summarize(n) == aggregate_;
+  }
+
+ private:
+  template <class Node>
+  static Type Summarize(const Node* n) {
+    Type aggregate = Lift(n);
+    if (n->Left()) {
+      aggregate = AggregatePolicy::Combine(n->Left()->SubtreeAggregate(),
+                                           aggregate);
+    }
+    if (n->Right()) {
+      aggregate = AggregatePolicy::Combine(aggregate,
+                                           n->Right()->SubtreeAggregate());
+    }
+    return aggregate;
+  }
+
+  // Overload ranks, as in AVLDefaultCompare below.
+  struct UseValue {};
+  struct UseKey : UseValue {};
+
+  template <class Item>
+  static auto Lift(const Item* n, UseKey)
+      -> decltype(AggregatePolicy::Of(n->Key(), n->Value())) {
+    return AggregatePolicy::Of(n->Key(), n->Value());
+  }
+
+  template <class Item>
+  static Type Lift(const Item* n, UseValue) {
+    return AggregatePolicy::Of(n->Value());
+  }
+
+  Type aggregate_;
+};
+
+template <> class AVLAggregateNode<AVLNoAggregate> {
+ public:
+  template <class Node>
+  void UpdateAggregate(const Node*) {
+  }
+
+  template <class Node>
+  bool AggregateIsCurrent(const Node*) const {
+    return true;
+  }
+};
+
+// Default three-way comparator. Returns a negative number, zero or a
+// positive number as lhs orders before, with or after rhs, making one
+// compare() call where the key type has one, as std::string does, and
+// otherwise using <=> or two operator< calls. It is transparent, so a
+// tree of std::string can be searched with std::string_view or const
+// char* without building a temporary key.
+struct AVLDefaultCompare {
+  typedef void is_transparent;
+
+  template <class L, class R>
+  int operator()(const L& lhs, const R& rhs) const {
+    return ThreeWay(lhs, rhs, UseCompare());
+  }
+
+ private:
+  // Overload ranks: the first ThreeWay that compiles is used.
+  struct UseLess {};
+  struct UseSpaceship : UseLess {};
+  struct UseCompare : UseSpaceship {};
+
+  template <class L, class R>
+  static auto ThreeWay(const L& lhs, const R& rhs, UseCompare)
+      -> decltype(static_cast<int>(lhs.compare(rhs))) {
+    int result = lhs.compare(rhs);
+    return (result > 0) - (result < 0);
+  }
+
+#if defined(__cpp_impl_three_way_comparison)
+  template <class L, class R>
+  static auto ThreeWay(const L& lhs, const R& rhs, UseSpaceship)
+      -> decltype((lhs <=> rhs) < 0, int()) {
+    auto result = lhs <=> rhs;
+    return (result > 0) - (result < 0);
+  }
+#endif
+
+  template <class L, class R>
+  static int ThreeWay(const L& lhs, const R& rhs, UseLess) {
+    return (lhs < rhs) ? -1 : static_cast<int>(rhs < lhs);
+  }
+};
+
+// Counters returned by AVLTree::Stats().
+struct AVLStats {
+  uint64_t comparisons;
+  uint64_t nodes_visited;
+  uint64_t single_rotations;
+  uint64_t double_rotations;
+  uint64_t allocations;
+  int height;
+  size_t size;
+};
+
+// Default StatsPolicy: every hook is empty, so nothing is counted and no
+// code is left behind.
+class AVLNoStats {
+ public:
+  static const bool kEnabled = false;
+
+  class Scope {
+   public:
+    explicit Scope(const AVLNoStats*) {}
+  };
+
+  static void CountComparison() {}
+  static void CountVisit() {}
+  static void CountRotation(bool) {}
+  static void CountAllocation() {}
+};
+
+// StatsPolicy that counts what the tree does. Node code has no pointer
+// back to its tree, so each AVLTree call opens a Scope that points this
+// thread's hooks at the tree's counters; work outside any Scope, such as
+// on threads forked by Union(), is not counted. Concurrent readers may
+// lose increments, but never corrupt the tree.
+class AVLOperationStats {
+ public:
+  static const bool kEnabled = true;
+
+  class Scope {
+   public:
+    explicit Scope(const AVLOperationStats* stats) : saved_(Current()) {
+      Current() = const_cast<AVLOperationStats*>(stats);
+    }
+
+    ~Scope() {
+      Current() = saved_;
+    }
+
+   private:
+    AVLOperationStats* saved_;
+
+    Scope(const Scope&);
+    Scope& operator=(const Scope&);
+  };
+
+  AVLOperationStats() {
+    Reset();
+  }
+
+  static void CountComparison() {
+    Bump(&AVLOperationStats::comparisons_);
+  }
+
+  static void CountVisit() {
+    Bump(&AVLOperationStats::nodes_visited_);
+  }
+
+  static void CountRotation(bool twice) {
+    Bump(twice ? &AVLOperationStats::double_rotations_
+               : &AVLOperationStats::single_rotations_);
+  }
+
+  static void CountAllocation() {
+    Bump(&AVLOperationStats::allocations_);
+  }
+
+  // Fills in every counter of stats but height and size.
+  void Read(AVLStats* stats) const {
+    stats->comparisons = comparisons_.load(std::memory_order_relaxed);
+    stats->nodes_visited = nodes_visited_.load(std::memory_order_relaxed);
+    stats->single_rotations =
+        single_rotations_.load(std::memory_order_relaxed);
+    stats->double_rotations =
+        double_rotations_.load(std::memory_order_relaxed);
+    stats->allocations = allocations_.load(std::memory_order_relaxed);
+  }
+
+  void Reset() {
+    comparisons_.store(0, std::memory_order_relaxed);
+    nodes_visited_.store(0, std::memory_order_relaxed);
+    single_rotations_.store(0, std::memory_order_relaxed);
+    double_rotations_.store(0, std::memory_order_relaxed);
+    allocations_.store(0, std::memory_order_relaxed);
+  }
+
  private:
+  typedef std::atomic<uint64_t> Counter;
+
+  static AVLOperationStats*& Current() {
+    static thread_local AVLOperationStats* current = NULL;
+    return current;
+  }
+
+  // A relaxed load and store rather than a locked add, so counting costs
+  // what a plain increment does.
+  static void Bump(Counter AVLOperationStats::*counter) {
+    AVLOperationStats* stats = Current();
+    if (stats) {
+      Counter& c = stats->*counter;
+      c.store(c.load(std::memory_order_relaxed) + 1,
+              std::memory_order_relaxed);
+    }
+  }
+
+  Counter comparisons_;
+  Counter nodes_visited_;
+  Counter single_rotations_;
+  Counter double_rotations_;
+  Counter allocations_;
+};
+
+// KeyCompare is a three-way comparator like AVLDefaultCompare. It is
+// default-constructed wherever keys are compared, so it must be stateless.
+// StatsPolicy is AVLNoStats, or AVLOperationStats to make Stats()
+// available. AggregatePolicy is AVLNoAggregate, or a monoid such as
+// AVLSum to make Aggregate() available.
+template <class KeyType, class ValueType,
+          template <class> class Allocator = AVLPoolAllocator,
+          class SizePolicy = AVLNoSubtreeSize,
+          class KeyCompare = AVLDefaultCompare,
+          class StatsPolicy = AVLNoStats,
+          class AggregatePolicy = AVLNoAggregate>
+class AVLTree {
+ public:
   enum CompareResult {
     kMinCmp = -1,
     kEqCmp = 0,
@@ -46,31 +582,48 @@ template <class KeyType, class ValueType> class AVLTree {
     kRight = 1
   };
 
- public:
-
   class Comparable {
    private:
     KeyType key;
     ValueType value;
 
    public:
-    Comparable(KeyType key, ValueType value) : key(key), value(value) {}
+    Comparable(const KeyType& key, const ValueType& value) :
+        key(key),
+        value(value) {
+    }
+
+    // Constructs the key from key and the value from args in place.
+    template <class K, class... Args>
+    Comparable(std::piecewise_construct_t, K&& key, Args&&... args) :
+        key(std::forward<K>(key)),
+        value(std::forward<Args>(args)...) {
+    }
 
-    CompareResult Compare(KeyType key) const {
-      return (key == this->key) ? kEqCmp
-          : ((key < this->key) ? kMinCmp : kMaxCmp);
+    // Where key belongs relative to this item, with one call to
+    // KeyCompare.
+    template <class K>
+    CompareResult Compare(const K& key) const {
+      StatsPolicy::CountComparison();
+      int result = KeyCompare()(key, this->key);
+      return (result == 0) ? kEqCmp : ((result < 0) ? kMinCmp : kMaxCmp);
     }
 
-    KeyType Key() const {
+    const KeyType& Key() const {
       return key;
     }
 
-    ValueType Value() const {
+    const ValueType& Value() const {
+      return value;
+    }
+
+    ValueType& Value() {
       return value;
     }
 
-    void SetValue(ValueType v) {
-      value = v;
+    template <class V>
+    void SetValue(V&& v) {
+      value = std::forward<V>(v);
     }
   };
 
@@ -80,21 +633,52 @@ template <class KeyType, class ValueType> class AVLTree {
     kR = 1
   };
 
-  struct Node {
-    explicit Node(Comparable* item) :
-        item(item),
+  // AVL height is below 1.44 * log2(n + 2), so no tree that fits in a
+  // 64-bit address space is deeper than this.
+  enum {
+    kMaxHeight = 96
+  };
+
+  // Number of descents GetBatch() keeps in flight at once.
+  enum {
+    kBatchGroupSize = 16
+  };
+
+  struct Node;
+  typedef Allocator<Node> NodeAllocator;
+
+  // The item is stored inline, so a node is a single allocation and the
+  // key is read from the same cache line as the child links.
+  struct Node : public Comparable, public SizePolicy,
+                public AVLAggregateNode<AggregatePolicy> {
+    Node(const KeyType& key, const ValueType& value) :
+        Comparable(key, value),
         balance_factor(kE) {
       children[kLeft] = NULL;
       children[kRight] = NULL;
+      this->UpdateAggregate(this);
+      StatsPolicy::CountAllocation();
     }
 
-    ~Node() {
-      if (Left()) {
-        delete Left();
-      }
-      if (Right()) {
-        delete Right();
-      }
+    template <class K, class... Args>
+    Node(std::piecewise_construct_t, K&& key, Args&&... args) :
+        Comparable(std::piecewise_construct, std::forward<K>(key),
+                   std::forward<Args>(args)...),
+        balance_factor(kE) {
+      children[kLeft] = NULL;
+      children[kRight] = NULL;
+      this->UpdateAggregate(this);
+      StatsPolicy::CountAllocation();
+    }
+
+    static size_t Count(const Node* n) {
+      return n ? n->SubtreeSize() : 0;
+    }
+
+    // Recomputes the subtree size and aggregate from the children.
+    void Update() {
+      this->SetSubtreeSize(1 + Count(Left()) + Count(Right()));
+      this->UpdateAggregate(this);
     }
 
     bool IsLeftImbalance() const {
@@ -118,6 +702,7 @@ template <class KeyType, class ValueType> class AVLTree {
     }
 
     static int RotateOnce(Node*& root, Direction dir) {
+      StatsPolicy::CountRotation(false);
       Direction other_dir = Opposite(dir);
       Node* old_root = root;
 
@@ -133,6 +718,8 @@ template <class KeyType, class ValueType> class AVLTree {
           -((dir == kLeft) ?
             --(root->balance_factor) : ++(root->balance_factor));
 
+      old_root->Update();
+      root->Update();
       return  height_change;
     }
 
@@ -145,6 +732,7 @@ template <class KeyType, class ValueType> class AVLTree {
     }
 
     static int RotateTwice(Node*& root, Direction dir) {
+      StatsPolicy::CountRotation(true);
       Direction other_dir = Opposite(dir);
       Node* old_root = root;
       Node* old_other_dir_subtree = root->children[other_dir];
@@ -163,48 +751,151 @@ template <class KeyType, class ValueType> class AVLTree {
           -min(static_cast<int>(root->balance_factor), 0);
       root->balance_factor = 0;
 
+      old_root->Update();
+      old_other_dir_subtree->Update();
+      root->Update();
       return kHeightChange;
     }
 
-    static Comparable* Get(KeyType key, Node* root, CompareResult cmp) {
+    template <class K>
+    static Comparable* Get(const K& key, Node* root, CompareResult cmp) {
       CompareResult result;
       while (root &&  (result = root->Compare(key, cmp))) {
         root = root->children[(result < 0) ? kLeft : kRight];
       }
-      return root ? root->item : NULL;
+      return root;
     }
 
-    static Comparable* Insert(Comparable* item, Node*& root) {
-      int change;
-      return Insert(item, root, change);
+    // Links and directions taken on the way down from the root. Parents
+    // are not stored in nodes, so rebalancing walks back up this stack.
+    struct Path {
+      Path() : depth(0) {}
+
+      void Push(Node** link, Direction dir) {
+        links[depth] = link;
+        dirs[depth] = static_cast<int8_t>(dir);
+        depth++;
+      }
+
+      Node** links[kMaxHeight];
+      int8_t dirs[kMaxHeight];
+      int depth;
+    };
+
+    // Rebalancing stops early, but subtree sizes and aggregates still
+    // change all the way up to the root.
+    static void UpdateAncestors(const Path& path) {
+      if (!SizePolicy::kEnabled && !AggregatePolicy::kEnabled) {
+        return;
+      }
+      for (int i = path.depth - 1; i >= 0; i--) {
+        (*path.links[i])->Update();
+      }
     }
 
-    static Comparable* Insert(Comparable* item, Node*& root, int& change) { // NOLINT
-      if (root == NULL) {
-        root = new Node(item);
-        change = kHeightChange;
+    // The item with the largest key not greater than key, or NULL.
+    template <class K>
+    static Comparable* GetLowerNearest(const K& key, Node* root) {
+      Node* last_node_lt_key = NULL;
+      Node* n = root;
+
+      while (n != NULL) {
+        CompareResult result = n->Compare(key);
+        if (result == kEqCmp) {
+          return n;
+        } else if (result == kMaxCmp) {
+          last_node_lt_key = n;
+          n = n->Right();
+        } else {
+          n = n->Left();
+        }
+      }
+      if (last_node_lt_key == NULL) {
         return NULL;
+      } else {
+        return last_node_lt_key;
       }
+    }
 
-      Comparable* found = NULL;
-      CompareResult result = root->Compare(item->Key());
-      Direction dir = (result == kMinCmp) ? kLeft : kRight;
+    // Returns n's memory to pool.
+    static void Destroy(Node* n, NodeAllocator& pool) {  // NOLINT
+      n->~Node();
+      pool.Free(n);
+    }
 
-      int increase = 0;
-      if (result != kEqCmp) {
-        found = Insert(item, root->children[dir], change);
-        if (found) {
-          return found;
+    // Rotates left children up until the node at hand has none, then frees
+    // it and moves right. Needs no stack however the tree is shaped.
+    // Returns the number of nodes freed.
+    static size_t DestroyTree(Node* n, NodeAllocator& pool) {  // NOLINT
+      size_t count = 0;
+      while (n) {
+        Node* left = n->Left();
+        if (left) {
+          n->children[kLeft] = left->Right();
+          left->children[kRight] = n;
+          n = left;
+        } else {
+          Node* right = n->Right();
+          Destroy(n, pool);
+          n = right;
+          count++;
         }
-        increase = result * change;
-      } else  {
-        increase = kHeightNoChange;
-        return root->item;
       }
+      return count;
+    }
+
+    // Returns the existing node if key is already in the tree, otherwise
+    // links a new node allocated from pool and returns NULL.
+    static Node* Insert(const KeyType& key, const ValueType& value,
+                        Node*& root, NodeAllocator& pool) {  // NOLINT
+      return InsertWith(key, root, [&]() {
+        return new(pool.Allocate()) Node(key, value);
+      });
+    }
 
-      root->balance_factor += increase;
-      change = (increase && root->balance_factor)
-          ? (1 - ReBalance(root)) : kHeightNoChange;
+    // As above, but the new node is whatever make_node() returns. It is
+    // only called if key is absent, and its key must equal key.
+    template <class MakeNode>
+    static Node* InsertWith(const KeyType& key, Node*& root,
+                            MakeNode make_node) {
+      Path path;
+      return InsertWith(key, &root, &path, make_node);
+    }
+
+    // As above, but descends from *link, whose ancestors are already on
+    // path, and rebalances up through them. Afterwards the nodes above
+    // path->depth are where they were; the one at that depth may have
+    // been rotated away.
+    template <class MakeNode>
+    static Node* InsertWith(const KeyType& key, Node** link, Path* path,
+                            MakeNode make_node) {
+      while (*link) {
+        CompareResult result = (*link)->Compare(key);
+        if (result == kEqCmp) {
+          return *link;
+        }
+        Direction dir = (result == kMinCmp) ? kLeft : kRight;
+        path->Push(link, dir);
+        link = &(*link)->children[dir];
+      }
+      *link = make_node();
+
+      // The new leaf grew its parent's subtree. Walk up until a subtree
+      // absorbs the growth; a rotation always restores the old height.
+      while (path->depth > 0) {
+        --path->depth;
+        Node*& n = *path->links[path->depth];
+        n->Update();
+        n->balance_factor += (path->dirs[path->depth] == kLeft) ? kL : kR;
+        if (n->balance_factor == kE) {
+          break;
+        }
+        if (n->IsLeftImbalance() || n->IsRightImbalance()) {
+          ReBalance(n);
+          break;
+        }
+      }
+      UpdateAncestors(*path);
       return NULL;
     }
 
@@ -228,167 +919,1592 @@ template <class KeyType, class ValueType> class AVLTree {
       return height_change;
     }
 
-    static Comparable* Remove(KeyType key, Node*& root, CompareResult cmp) {
-      int change;
-      return Remove(key, root, change, cmp);
-    }
-
-    static Comparable* Remove(const KeyType key,
-                              Node*& root,
-                              int& change,
-                              CompareResult cmp) {
-      if (root == NULL) {
-        change = kHeightNoChange;
-        return NULL;
+    // Height of the subtree at n, read off the balance factors along its
+    // taller side in O(log n).
+    static int Height(const Node* n) {
+      int height = 0;
+      for (; n; height++) {
+        n = n->children[(n->balance_factor < 0) ? kLeft : kRight];
       }
+      return height;
+    }
 
-      Comparable* found = NULL;
-      int decrease = 0;
-
-      CompareResult result = root->Compare(key, cmp);
-      Direction dir = (result == kMinCmp) ? kLeft : kRight;
+    // Height of n's dir subtree, given that n's subtree is height tall.
+    static int ChildHeight(const Node* n, int height, Direction dir) {
+      int taller = (dir == kLeft) ? kL : kR;
+      bool shorter = n->balance_factor != kE && n->balance_factor != taller;
+      return height - (shorter ? 2 : 1);
+    }
 
-      if (result != kEqCmp) {
-        found = Remove(key, root->children[dir], change, cmp);
-        if (!found) {
-          return found;
-        }
-        decrease = result * change;
-      } else  {
-        found = root->item;
-        if ((root->Left() == NULL) &&
-            (root->Right() == NULL)) {
-          delete root;
-          root = NULL;
-          change = kHeightChange;
-          return  found;
-        } else if ((root->Left() == NULL) ||
-                   (root->Right() == NULL)) {
-          Node* toDelete = root;
-          root = root->children[(root->Right()) ? kRight : kLeft];
-          change = kHeightChange;
-          toDelete->children[kLeft] = toDelete->children[kRight] = NULL;
-          delete  toDelete;
-          return  found;
-        } else {
-          root->item = Remove(key, root->children[kRight],
-                              decrease, kMinCmp);
-        }
+    // Returns a tree of the keys in left, then pivot, then the keys in
+    // right, and stores its height. Every key in left must be less than
+    // pivot's and every key in right greater. pivot's old links are
+    // ignored. Takes O(|left_height - right_height| + 1) time: pivot is
+    // hung off the taller tree where its side is about as tall as the
+    // other tree, and the rotations of Insert repair the way back up.
+    static Node* Join(Node* left, int left_height, Node* pivot,
+                      Node* right, int right_height, int* height) {
+      if (left_height >= right_height) {
+        return JoinInto(left, left_height, pivot, right, right_height,
+                        kRight, height);
       }
-      root->balance_factor -= decrease;
+      return JoinInto(right, right_height, pivot, left, left_height, kLeft,
+                      height);
+    }
 
-      if (decrease) {
-        if (root->balance_factor) {
-          change = ReBalance(root);
-        } else {
-          change = kHeightChange;
-        }
-      } else {
-        change = kHeightNoChange;
+    // Join() without a pivot. Costs an extra O(log n) to unlink the last
+    // node of left and measure what is left.
+    static Node* Join(Node* left, int left_height, Node* right,
+                      int right_height, int* height) {
+      if (left == NULL) {
+        *height = right_height;
+        return right;
       }
-      return  found;
+      if (right == NULL) {
+        *height = left_height;
+        return left;
+      }
+      Node* pivot = Remove(left->Key(), left, kMaxCmp);
+      return Join(left, Height(left), pivot, right, right_height, height);
     }
 
-    CompareResult Compare(KeyType key, CompareResult cmp = kEqCmp) const {
-      switch (cmp) {
+    // Splits the subtree at n, which is height tall, into the keys less
+    // than key and the keys greater than it, and unlinks the node with
+    // key itself into found, or stores NULL there. Takes O(log n): the
+    // pieces cut off on the way down are joined in order of height.
+    static void Split(Node* n, int height, const KeyType& key,
+                      Node** left, int* left_height, Node** found,
+                      Node** right, int* right_height) {
+      if (n == NULL) {
+        *left = *found = *right = NULL;
+        *left_height = *right_height = 0;
+        return;
+      }
+      Node* l = n->Left();
+      Node* r = n->Right();
+      int l_height = ChildHeight(n, height, kLeft);
+      int r_height = ChildHeight(n, height, kRight);
+      Node* rest;
+      int rest_height;
+      switch (n->Compare(key)) {
         case kEqCmp:
-          return item->Compare(key);
+          *left = l;
+          *left_height = l_height;
+          *right = r;
+          *right_height = r_height;
+          n->children[kLeft] = n->children[kRight] = NULL;
+          n->balance_factor = kE;
+          n->Update();
+          *found = n;
+          break;
         case kMinCmp:
-          return  (children[kLeft] == NULL) ? kEqCmp : kMinCmp;
+          Split(l, l_height, key, left, left_height, found, &rest,
+                &rest_height);
+          *right = Join(rest, rest_height, n, r, r_height, right_height);
+          break;
         default:
-          return (children[kRight] == NULL) ? kEqCmp : kMaxCmp;
+          Split(r, r_height, key, &rest, &rest_height, found, right,
+                right_height);
+          *left = Join(l, l_height, n, rest, rest_height, left_height);
+          break;
       }
     }
 
-    Node* children[2];
-    Comparable* item;
-    int balance_factor;
-
-   private:
-    Node() {}
-    Node(const Node& n) {}
-    Node & operator=(const Node&) {}
-  };
+    // Join() with the taller tree tall on pivot's other side from dir.
+    static Node* JoinInto(Node* tall, int tall_height, Node* pivot,
+                          Node* small, int small_height, Direction dir,
+                          int* height) {
+      Direction other_dir = Opposite(dir);
+      int sign = (dir == kRight) ? 1 : -1;
+      if (tall_height <= small_height + 1) {
+        pivot->children[other_dir] = tall;
+        pivot->children[dir] = small;
+        pivot->balance_factor =
+            static_cast<int8_t>(sign * (small_height - tall_height));
+        pivot->Update();
+        *height = tall_height + 1;
+        return pivot;
+      }
+      int inner_height;
+      tall->children[dir] = JoinInto(
+          tall->children[dir], ChildHeight(tall, tall_height, dir), pivot,
+          small, small_height, dir, &inner_height);
+      int outer_height = ChildHeight(tall, tall_height, other_dir);
+      tall->balance_factor =
+          static_cast<int8_t>(sign * (inner_height - outer_height));
+      tall->Update();
+      *height = max(inner_height, outer_height) + 1;
+      if (tall->IsLeftImbalance() || tall->IsRightImbalance()) {
+        // Only a single rotation of an even child leaves it on top.
+        bool even = tall->children[dir]->balance_factor == kE;
+        *height = inner_height + (even ? 1 : 0);
+        ReBalance(tall);
+      }
+      return tall;
+    }
 
-  AVLTree() : root_(NULL) {
-  }
+    struct NoRotationHook {
+      void operator()(Node*) const {
+      }
+    };
+
+    // Returns a new node from pool with n's item, links, balance factor,
+    // subtree size and aggregate.
+    static Node* Clone(const Node* n, NodeAllocator& pool) {  // NOLINT
+      Node* copy = new(pool.Allocate()) Node(n->Key(), n->Value());
+      copy->children[kLeft] = n->Left();
+      copy->children[kRight] = n->Right();
+      copy->balance_factor = n->balance_factor;
+      copy->SetSubtreeSize(n->SubtreeSize());
+      copy->UpdateAggregate(copy);
+      return copy;
+    }
 
-  virtual ~AVLTree() {
-    if (root_) {
-      delete root_;
+    // Replaces every node that an in-place Insert of key, or Remove of key
+    // if with_successor is set, modifies on its way down with copy(n), and
+    // returns the new root. Copy-on-write trees call this and then run
+    // Insert or Remove on the copies, leaving the old nodes untouched.
+    template <class CopyFunction>
+    static Node* CopyPath(Node* root, const KeyType& key,
+                          bool with_successor,
+                          CopyFunction& copy) {  // NOLINT
+      Node** link = &root;
+      while (*link) {
+        Node* n = copy(*link);
+        *link = n;
+        CompareResult result = n->Compare(key);
+        if (result == kEqCmp) {
+          if (with_successor && n->Left() && n->Right()) {
+            for (link = &n->children[kRight]; *link;
+                 link = &(*link)->children[kLeft]) {
+              *link = copy(*link);
+            }
+          }
+          break;
+        }
+        link = &n->children[(result == kMinCmp) ? kLeft : kRight];
+      }
+      return root;
     }
-  }
+
+    // Rotation hook for Remove on a copied path. Copies the nodes on n's
+    // taller side that the rotation at n moves; n itself is a copy.
+    template <class CopyFunction>
+    struct CopyRotated {
+      explicit CopyRotated(CopyFunction* copy) : copy(copy) {}
+
+      void operator()(Node* n) const {
+        Direction heavy = n->IsLeftImbalance() ? kLeft : kRight;
+        Node* child = (*copy)(n->children[heavy]);
+        n->children[heavy] = child;
+        if (child->balance_factor == ((heavy == kLeft) ? kR : kL)) {
+          Direction inner = Opposite(heavy);
+          child->children[inner] = (*copy)(child->children[inner]);
+        }
+      }
+
+      CopyFunction* copy;
+    };
+
+    // Unlinks the matching node and hands it back to the caller, who is
+    // responsible for freeing it.
+    static Node* Remove(const KeyType& key, Node*& root, CompareResult cmp) {
+      NoRotationHook hook;
+      return Remove(key, root, cmp, hook);
+    }
+
+    // As above, but calls before_rotation(n) just before the subtree at n
+    // is rotated. Copy-on-write callers use it to copy the nodes on n's
+    // taller side, which the rotation moves but the descent never visited.
+    template <class RotationHook>
+    static Node* Remove(const KeyType& key, Node*& root, CompareResult cmp,
+                        RotationHook& before_rotation) {  // NOLINT
+      Path path;
+      return Remove(key, &root, &path, cmp, before_rotation);
+    }
+
+    // As above, but descends from *link, whose ancestors are already on
+    // path, like the InsertWith() that takes a path.
+    template <class RotationHook>
+    static Node* Remove(const KeyType& key, Node** link, Path* path,
+                        CompareResult cmp,
+                        RotationHook& before_rotation) {  // NOLINT
+      CompareResult result;
+      while (*link && (result = (*link)->Compare(key, cmp))) {
+        Direction dir = (result == kMinCmp) ? kLeft : kRight;
+        path->Push(link, dir);
+        link = &(*link)->children[dir];
+      }
+      Node* found = *link;
+      if (found == NULL) {
+        return NULL;
+      }
+
+      if (found->Left() && found->Right()) {
+        // Unlink the in-order successor and move it into found's place.
+        int found_depth = path->depth;
+        path->Push(link, kRight);
+        Node** successor_link = &found->children[kRight];
+        while ((*successor_link)->Left()) {
+          path->Push(successor_link, kLeft);
+          successor_link = &(*successor_link)->children[kLeft];
+        }
+        Node* successor = *successor_link;
+        *successor_link = successor->Right();
+        successor->children[kLeft] = found->Left();
+        successor->children[kRight] = found->Right();
+        successor->balance_factor = found->balance_factor;
+        *link = successor;
+        if (found_depth + 1 < path->depth) {
+          path->links[found_depth + 1] = &successor->children[kRight];
+        }
+      } else {
+        *link = found->children[found->Right() ? kRight : kLeft];
+      }
+
+      // A subtree on the path lost height. Walk up until one keeps its
+      // height, either because it was even or because a rotation left it
+      // unchanged.
+      while (path->depth > 0) {
+        --path->depth;
+        Node*& n = *path->links[path->depth];
+        n->Update();
+        n->balance_factor -= (path->dirs[path->depth] == kLeft) ? kL : kR;
+        if (n->balance_factor == kL || n->balance_factor == kR) {
+          break;
+        }
+        if (n->balance_factor != kE) {
+          before_rotation(n);
+          if (ReBalance(n) == kHeightNoChange) {
+            break;
+          }
+        }
+      }
+      UpdateAncestors(*path);
+      return found;
+    }
+
+    template <class K>
+    CompareResult Compare(const K& key, CompareResult cmp = kEqCmp) const {
+      StatsPolicy::CountVisit();
+      switch (cmp) {
+        case kEqCmp:
+          return Comparable::Compare(key);
+        case kMinCmp:
+          return  (children[kLeft] == NULL) ? kEqCmp : kMinCmp;
+        default:
+          return (children[kRight] == NULL) ? kEqCmp : kMaxCmp;
+      }
+    }
+
+    Node* children[2];
+    int8_t balance_factor;
+
+   private:
+    Node();
+    Node(const Node& n);
+    Node & operator=(const Node&);
+  };
+
+  // In-order bidirectional iterator. Nodes have no parent links, so the
+  // iterator carries the path from the root to the current node and never
+  // allocates. Adding or removing keys invalidates every iterator.
+  class Iterator {
+   public:
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef Comparable value_type;
+    typedef ptrdiff_t difference_type;
+    typedef Comparable* pointer;
+    typedef Comparable& reference;
+
+    Iterator() : root_(NULL), depth_(0) {}
+
+    Iterator(const Iterator& other) {
+      *this = other;
+    }
+
+    Iterator& operator=(const Iterator& other) {
+      root_ = other.root_;
+      depth_ = other.depth_;
+      for (int i = 0; i < depth_; i++) {
+        path_[i] = other.path_[i];
+      }
+      return *this;
+    }
+
+    reference operator*() const {
+      return *Current();
+    }
+
+    pointer operator->() const {
+      return Current();
+    }
+
+    Iterator& operator++() {
+      Step(kRight);
+      return *this;
+    }
+
+    Iterator operator++(int) {
+      Iterator old(*this);
+      Step(kRight);
+      return old;
+    }
+
+    // Decrementing end() moves to the last item.
+    Iterator& operator--() {
+      if (depth_ == 0) {
+        PushEdge(root_, kRight);
+      } else {
+        Step(kLeft);
+      }
+      return *this;
+    }
+
+    Iterator operator--(int) {
+      Iterator old(*this);
+      --*this;
+      return old;
+    }
+
+    bool operator==(const Iterator& other) const {
+      return Current() == other.Current();
+    }
+
+    bool operator!=(const Iterator& other) const {
+      return !(*this == other);
+    }
+
+    // Positions on the first item in the tree at root whose key is not
+    // less than key, or greater than key if skip_equal is set. Any
+    // iterator at end() compares equal to a default-constructed one.
+    template <class K>
+    static Iterator Bound(Node* root, const K& key, bool skip_equal) {
+      Iterator it(root);
+      int bound_depth = 0;
+      for (Node* n = root; n;) {
+        it.Push(n);
+        CompareResult result = n->Compare(key);
+        if (result == kMinCmp || (result == kEqCmp && !skip_equal)) {
+          bound_depth = it.depth_;
+          if (result == kEqCmp) {
+            break;
+          }
+          n = n->Left();
+        } else {
+          n = n->Right();
+        }
+      }
+      it.depth_ = bound_depth;
+      return it;
+    }
+
+   private:
+    friend class AVLTree;
+
+    explicit Iterator(Node* root) : root_(root), depth_(0) {}
+
+    Node* Current() const {
+      return depth_ ? path_[depth_ - 1] : NULL;
+    }
+
+    void Push(Node* n) {
+      path_[depth_++] = n;
+    }
+
+    // Pushes n and then follows dir until the edge of its subtree.
+    void PushEdge(Node* n, Direction dir) {
+      for (; n; n = n->children[dir]) {
+        Push(n);
+      }
+    }
+
+    // Moves to the in-order neighbour in direction dir, or to end().
+    void Step(Direction dir) {
+      Node* n = Current();
+      if (n->children[dir]) {
+        PushEdge(n->children[dir], Node::Opposite(dir));
+        return;
+      }
+      Node* child;
+      do {
+        child = path_[--depth_];
+      } while (depth_ > 0 && path_[depth_ - 1]->children[dir] == child);
+    }
+
+    Node* root_;
+    Node* path_[kMaxHeight];
+    int depth_;
+  };
+
+  typedef Iterator iterator;
+  typedef Iterator const_iterator;
+
+  // Position in a tree that later seeks start from instead of the root,
+  // for runs of operations on nearby keys. Like Iterator it keeps the
+  // path from the root, here as links so that it can insert and remove
+  // in place. A seek climbs only to the nearest ancestor whose subtree
+  // spans the new key, which is O(log d) for a key d items away unless
+  // the two keys straddle a node high up. Writes through the cursor keep
+  // it valid; any other write to the tree invalidates it.
+  class Cursor {
+   public:
+    // Starts at the end.
+    explicit Cursor(AVLTree* tree) : tree_(tree) {
+      path_.links[0] = &tree->root_;
+      lo_[0] = hi_[0] = -1;
+    }
+
+    // The item at the cursor, or NULL at the end.
+    Comparable* Current() const {
+      return path_.depth ? *path_.links[path_.depth - 1] : NULL;
+    }
+
+    // Moves to the first item whose key is not less than key, or to the
+    // end. Returns true if that item's key equals key. After a miss,
+    // Prev() moves to the item GetLowerNearest() would return.
+    bool Seek(const KeyType& key) {
+      typename StatsPolicy::Scope scope(&tree_->stats_);
+      return Descend(Climb(key), key);
+    }
+
+    // Moves to the next item, or from the last item to the end.
+    void Next() {
+      if (path_.depth) {
+        Step(kRight);
+      }
+    }
+
+    // Moves to the previous item, or from the end to the last item.
+    void Prev() {
+      if (path_.depth == 0) {
+        if (tree_->root_) {
+          path_.depth = 1;
+          PushEdge(kRight);
+        }
+      } else {
+        Step(kLeft);
+      }
+    }
+
+    // Adds key with value, or assigns value to the existing item, and
+    // moves to it. Returns true if an item was added. Rebalancing costs
+    // amortized O(1) on top of the seek.
+    bool InsertHint(const KeyType& key, const ValueType& value) {
+      typename StatsPolicy::Scope scope(&tree_->stats_);
+      HeightUpdate height_update(tree_);
+      int level = Climb(key);
+      path_.depth = level;
+      Node* found = Node::InsertWith(key, path_.links[level], &path_, [&]() {
+        return new(tree_->pool_.Allocate()) Node(key, value);
+      });
+      if (found) {
+        found->SetValue(value);
+        // The path holds found's ancestors.
+        if (AggregatePolicy::kEnabled) {
+          found->Update();
+          Node::UpdateAncestors(path_);
+        }
+      } else {
+        tree_->size_++;
+      }
+      // Bounds are only known down to level, and rebalancing may have
+      // rotated the node it stopped at.
+      Descend(std::min(path_.depth, level), key);
+      return found == NULL;
+    }
+
+    // Removes the item at the cursor, if any, and moves to the next one.
+    void EraseAt() {
+      if (path_.depth == 0) {
+        return;
+      }
+      typename StatsPolicy::Scope scope(&tree_->stats_);
+      HeightUpdate height_update(tree_);
+      int level = path_.depth - 1;
+      Node* n = *path_.links[level];
+      path_.depth = level;
+      typename Node::NoRotationHook hook;
+      Node::Remove(n->Key(), path_.links[level], &path_, kEqCmp, hook);
+      // n is unlinked but still readable, so seek past its key.
+      Descend(std::min(path_.depth, level), n->Key());
+      Node::Destroy(n, tree_->pool_);
+      tree_->size_--;
+    }
+
+   private:
+    Node* NodeAt(int level) const {
+      return *path_.links[level];
+    }
+
+    // True if key falls strictly between the ancestors bounding the
+    // subtree at level.
+    bool Spans(int level, const KeyType& key) const {
+      return (lo_[level] < 0 || NodeAt(lo_[level])->Compare(key) == kMaxCmp)
+          && (hi_[level] < 0 || NodeAt(hi_[level])->Compare(key) == kMinCmp);
+    }
+
+    // Deepest level on the path whose subtree spans key, or the root.
+    int Climb(const KeyType& key) const {
+      int level = path_.depth - 1;
+      while (level > 0 && !Spans(level, key)) {
+        level--;
+      }
+      return (level > 0) ? level : 0;
+    }
+
+    // Follows dir from the node at the bottom of the path and records its
+    // bounds.
+    void PushChild(Direction dir) {
+      int parent = path_.depth - 1;
+      path_.dirs[parent] = static_cast<int8_t>(dir);
+      path_.links[parent + 1] = &NodeAt(parent)->children[dir];
+      lo_[parent + 1] = (dir == kRight) ? parent : lo_[parent];
+      hi_[parent + 1] = (dir == kLeft) ? parent : hi_[parent];
+      path_.depth++;
+    }
+
+    // Follows dir from the bottom of the path to the edge of its subtree.
+    void PushEdge(Direction dir) {
+      while (NodeAt(path_.depth - 1)->children[dir]) {
+        PushChild(dir);
+      }
+    }
+
+    // Moves to the in-order neighbour in direction dir, or to the end.
+    void Step(Direction dir) {
+      if (NodeAt(path_.depth - 1)->children[dir]) {
+        PushChild(dir);
+        PushEdge(Node::Opposite(dir));
+        return;
+      }
+      do {
+        path_.depth--;
+      } while (path_.depth > 0 && path_.dirs[path_.depth - 1] == dir);
+    }
+
+    // Cuts the path back to level, whose subtree must span key, and
+    // descends from there to the first item not less than key, as
+    // Iterator::Bound() does from the root.
+    bool Descend(int level, const KeyType& key) {
+      path_.depth = level + 1;
+      // Past the subtree's last key comes its upper bounding ancestor.
+      int bound_depth = hi_[level] + 1;
+      while (NodeAt(path_.depth - 1)) {
+        CompareResult result = NodeAt(path_.depth - 1)->Compare(key);
+        if (result == kEqCmp) {
+          return true;
+        }
+        if (result == kMinCmp) {
+          bound_depth = path_.depth;
+          PushChild(kLeft);
+        } else {
+          PushChild(kRight);
+        }
+      }
+      path_.depth = bound_depth;
+      return false;
+    }
+
+    AVLTree* tree_;
+    typename Node::Path path_;
+    // Levels of the nearest ancestors below and above the keys in the
+    // subtree at each level, or -1.
+    int8_t lo_[kMaxHeight];
+    int8_t hi_[kMaxHeight];
+  };
+
+  AVLTree() : root_(NULL), size_(0), height_(0) {
+  }
+
+  // Builds the tree from [first, last); see BuildFromSorted().
+  template <class RandomIt>
+  AVLTree(RandomIt first, RandomIt last) :
+      root_(NULL),
+      size_(0),
+      height_(0) {
+    BuildFromSorted(first, last);
+  }
+
+  virtual ~AVLTree() {
+    Clear();
+  }
+
+  // Destroys every node. With a bulk-releasing allocator and trivially
+  // destructible items this is O(chunks) instead of a walk over all nodes.
+  void Clear() {
+    if (!NodeAllocator::kBulkRelease ||
+        !std::is_trivially_destructible<Node>::value) {
+      Node::DestroyTree(root_, pool_);
+    }
+    pool_.ReleaseAll();
+    root_ = NULL;
+    size_ = 0;
+    height_ = 0;
+  }
 
   Node* Root() const {
     return root_;
   }
 
-  void Add(const KeyType key, const ValueType value) {
-    Comparable* item = new Comparable(key, value);
-    Comparable* result = Node::Insert(item, root_);
-    if (result) {
-      result->SetValue(value);
-      delete item;
+  void Add(const KeyType& key, const ValueType& value) {
+    InsertOrAssign(key, value);
+  }
+
+  // Adds key with value, or assigns value to the existing item. The bool
+  // is true if an item was added.
+  template <class K, class V>
+  std::pair<Comparable*, bool> InsertOrAssign(K&& key, V&& value) {
+    typename StatsPolicy::Scope scope(&stats_);
+    std::pair<Comparable*, bool> result =
+        TryEmplace(std::forward<K>(key), std::forward<V>(value));
+    if (!result.second) {
+      // TryEmplace() left value alone, so it is still ours to forward.
+      result.first->SetValue(std::forward<V>(value));
+      RefreshAggregates(result.first->Key());
     }
+    return result;
   }
 
-  Comparable* Remove(const KeyType key, CompareResult cmp = kEqCmp) {
-    return Node::Remove(key, root_, cmp);
+  // Adds key with a value constructed in place from args, unless key is
+  // already present. Then neither key nor args are moved from and the
+  // existing item is returned with false.
+  template <class K, class... Args>
+  std::pair<Comparable*, bool> TryEmplace(K&& key, Args&&... args) {
+    typename StatsPolicy::Scope scope(&stats_);
+    static_assert(
+        std::is_same<typename std::decay<K>::type, KeyType>::value,
+        "TryEmplace needs a KeyType key");
+    HeightUpdate height_update(this);
+    Node* added = NULL;
+    Node* found = Node::InsertWith(key, root_, [&]() {
+      added = new(pool_.Allocate()) Node(std::piecewise_construct,
+                                         std::forward<K>(key),
+                                         std::forward<Args>(args)...);
+      return added;
+    });
+    if (found) {
+      return std::pair<Comparable*, bool>(found, false);
+    }
+    size_++;
+    return std::pair<Comparable*, bool>(added, true);
   }
 
-  Comparable* Get(const KeyType key, CompareResult cmp = kEqCmp) const {
-    return Node::Get(key, root_, cmp);
+  // Constructs the key from key and the value from args, then adds the
+  // item unless its key is already present. Unlike TryEmplace() the key
+  // may be any type KeyType can be constructed from, but the item is
+  // built, and thrown away, even when the key is found.
+  template <class K, class... Args>
+  std::pair<Comparable*, bool> Emplace(K&& key, Args&&... args) {
+    typename StatsPolicy::Scope scope(&stats_);
+    Node* n = new(pool_.Allocate()) Node(std::piecewise_construct,
+                                         std::forward<K>(key),
+                                         std::forward<Args>(args)...);
+    HeightUpdate height_update(this);
+    Node* found = Node::InsertWith(n->Key(), root_, [n]() { return n; });
+    if (found) {
+      Node::Destroy(n, pool_);
+      return std::pair<Comparable*, bool>(found, false);
+    }
+    size_++;
+    return std::pair<Comparable*, bool>(n, true);
   }
 
-  Comparable* GetLowerNearest(const KeyType key) const {
-    Node* last_node_lt_key = NULL;
-    Node* n = root_;
+  // Replaces the contents with the std::pair-like items in [first, last),
+  // which must be sorted by strictly increasing key. Takes O(n) with no
+  // comparisons or rotations, and places the nodes in one block in key
+  // order when the allocator supports arrays.
+  template <class RandomIt>
+  void BuildFromSorted(RandomIt first, RandomIt last) {
+    BuildFromSortedParallel(first, last, 1);
+  }
 
-    while (n != NULL) {
-      if (n->item->Key() == key) {
-        return n->item;
-      } else if (n->item->Key() < key) {
-        last_node_lt_key = n;
-        n = n->Right();
-      } else {
-        n = n->Left();
-      }
+  // Like BuildFromSorted(), but builds disjoint subtrees on up to threads
+  // threads. Runs on the calling thread alone unless the allocator
+  // supports arrays.
+  template <class RandomIt>
+  void BuildFromSortedParallel(RandomIt first, RandomIt last,
+                               size_t threads) {
+    typename StatsPolicy::Scope scope(&stats_);
+    Clear();
+    size_t n = last - first;
+    if (n == 0) {
+      return;
     }
-    if (last_node_lt_key == NULL) {
-      return NULL;
+    SortedBuilder<RandomIt> builder;
+    builder.first = first;
+    builder.block = static_cast<Node*>(pool_.AllocateArray(n));
+    builder.pool = &pool_;
+    int forks = builder.block ? Forks(threads) : 0;
+    root_ = builder.Build(0, n, forks, &height_);
+    size_ = n;
+  }
+
+  // Adds the std::pair-like items in [first, last) as if by Add() in
+  // order, in one pass down the tree instead of one descent per item.
+  // The batch is split around each node it reaches and the halves are
+  // added to the node's subtrees, which are then joined back around the
+  // node, so paths shared by several items are walked once. Takes
+  // O(m log(n / m + 1)) for m items plus sorting them, which is skipped
+  // if keys already strictly increase. Large batches are split on up to
+  // threads threads.
+  template <class RandomIt>
+  void AddBatch(RandomIt first, RandomIt last, size_t threads = 1) {
+    typename StatsPolicy::Scope scope(&stats_);
+    size_t m = last - first;
+    if (m == 0) {
+      return;
+    }
+    BatchInserter<RandomIt> inserter;
+    inserter.first = first;
+    inserter.order = SortBatch(m, [first](size_t i) -> const KeyType& {
+      return first[i].first;
+    });
+    inserter.pool = &pool_;
+    int forks = Forks(threads);
+    if (forks > 0 && inserter.order.size() >= kMinForkBatch) {
+      // Threads must not share the pool, so draw a slot for every item up
+      // front, reusing freed ones, and give back those left unused.
+      inserter.slots.resize(m);
+      for (size_t i = 0; i < inserter.order.size(); i++) {
+        inserter.slots[inserter.order[i]] = pool_.Allocate();
+      }
     } else {
-      return last_node_lt_key->item;
+      forks = 0;
     }
+    size_t added = 0;
+    root_ = inserter.Insert(root_, height_, 0, inserter.order.size(), forks,
+                            &height_, &added);
+    for (size_t i = 0; i < inserter.slots.size(); i++) {
+      if (inserter.slots[i]) {
+        pool_.Free(inserter.slots[i]);
+      }
+    }
+    size_ += added;
   }
 
-  bool IsBalanced() const {
-    if (root_ == NULL) {
-      return true;
+  // Removes every key in [first, last) in one pass, the same way
+  // AddBatch() adds.
+  template <class RandomIt>
+  void RemoveBatch(RandomIt first, RandomIt last, size_t threads = 1) {
+    typename StatsPolicy::Scope scope(&stats_);
+    size_t m = last - first;
+    if (m == 0) {
+      return;
+    }
+    BatchRemover<RandomIt> remover;
+    remover.first = first;
+    remover.order = SortBatch(m, [first](size_t i) -> const KeyType& {
+      return first[i];
+    });
+    std::vector<Node*> garbage;
+    root_ = remover.Remove(root_, height_, 0, remover.order.size(),
+                           Forks(threads), &height_, &garbage);
+    for (size_t i = 0; i < garbage.size(); i++) {
+      Node::Destroy(garbage[i], pool_);
+    }
+    size_ -= garbage.size();
+  }
+
+  // Moves the items of other whose keys are not in this tree into it and
+  // leaves other empty. Where both trees have a key, this tree's item is
+  // kept. Takes O(m log(n / m + 1)) for trees of m <= n items, instead of
+  // O(m log(n + m)) for adding m items one by one, and the recursion runs
+  // on up to threads threads. other must be a different tree.
+  void Union(AVLTree* other, size_t threads = 1) {
+    Merge(kUnion, other, threads);
+  }
+
+  // Keeps only the items whose keys are also in other, and empties other.
+  // Costs as Union() does.
+  void Intersection(AVLTree* other, size_t threads = 1) {
+    Merge(kIntersection, other, threads);
+  }
+
+  // Removes the items whose keys are in other, and empties other. Costs
+  // as Union() does.
+  void Difference(AVLTree* other, size_t threads = 1) {
+    Merge(kDifference, other, threads);
+  }
+
+  // Returns true if an item was removed.
+  bool Remove(const KeyType& key, CompareResult cmp = kEqCmp) {
+    typename StatsPolicy::Scope scope(&stats_);
+    HeightUpdate height_update(this);
+    Node* node = Node::Remove(key, root_, cmp);
+    if (node == NULL) {
+      return false;
     }
-    int diff = abs(Height(root_->Left()) - Height(root_->Right()));
-    return diff <= 1;
+    Node::Destroy(node, pool_);
+    size_--;
+    return true;
+  }
+
+  Comparable* Get(const KeyType& key, CompareResult cmp = kEqCmp) const {
+    typename StatsPolicy::Scope scope(&stats_);
+    return Node::Get(key, root_, cmp);
+  }
+
+  // Stores the item for keys[i], or NULL, in out[i] for every i < n. The
+  // descents of up to kBatchGroupSize keys advance one level at a time
+  // and prefetch their next node, so their cache misses overlap instead
+  // of being paid one after another.
+  void GetBatch(const KeyType* keys, size_t n, Comparable** out) const {
+    typename StatsPolicy::Scope scope(&stats_);
+    Node* cursors[kBatchGroupSize];
+    for (size_t base = 0; base < n; base += kBatchGroupSize) {
+      size_t group = n - base;
+      if (group > kBatchGroupSize) {
+        group = kBatchGroupSize;
+      }
+      for (size_t i = 0; i < group; i++) {
+        cursors[i] = root_;
+        out[base + i] = NULL;
+      }
+      for (size_t active = group; active > 0;) {
+        active = 0;
+        for (size_t i = 0; i < group; i++) {
+          Node* n = cursors[i];
+          if (n == NULL) {
+            continue;
+          }
+          CompareResult result = n->Compare(keys[base + i]);
+          if (result == kEqCmp) {
+            out[base + i] = n;
+            cursors[i] = NULL;
+            continue;
+          }
+          n = n->children[(result == kMinCmp) ? kLeft : kRight];
+          if (n) {
+            AVL_TREE_PREFETCH(n);
+            active++;
+          }
+          cursors[i] = n;
+        }
+      }
+    }
+  }
+
+  // Looks up a key of another type that KeyCompare can compare with keys,
+  // such as a std::string_view in a tree of std::string. Only available
+  // when KeyCompare is transparent, i.e. defines is_transparent.
+  template <class K, class C = KeyCompare, class = typename C::is_transparent>
+  Comparable* Get(const K& key) const {
+    typename StatsPolicy::Scope scope(&stats_);
+    return Node::Get(key, root_, kEqCmp);
+  }
+
+  Comparable* GetLowerNearest(const KeyType& key) const {
+    typename StatsPolicy::Scope scope(&stats_);
+    return Node::GetLowerNearest(key, root_);
+  }
+
+  template <class K, class C = KeyCompare, class = typename C::is_transparent>
+  Comparable* GetLowerNearest(const K& key) const {
+    typename StatsPolicy::Scope scope(&stats_);
+    return Node::GetLowerNearest(key, root_);
+  }
+
+  iterator begin() const {
+    Iterator it(root_);
+    it.PushEdge(root_, kLeft);
+    return it;
+  }
+
+  iterator end() const {
+    return Iterator(root_);
+  }
+
+  // First item whose key is not less than key.
+  iterator lower_bound(const KeyType& key) const {
+    typename StatsPolicy::Scope scope(&stats_);
+    return Iterator::Bound(root_, key, false);
+  }
+
+  // First item whose key is greater than key.
+  iterator upper_bound(const KeyType& key) const {
+    typename StatsPolicy::Scope scope(&stats_);
+    return Iterator::Bound(root_, key, true);
+  }
+
+  std::pair<iterator, iterator> equal_range(const KeyType& key) const {
+    return std::make_pair(lower_bound(key), upper_bound(key));
+  }
+
+  template <class K, class C = KeyCompare, class = typename C::is_transparent>
+  iterator lower_bound(const K& key) const {
+    typename StatsPolicy::Scope scope(&stats_);
+    return Iterator::Bound(root_, key, false);
+  }
+
+  template <class K, class C = KeyCompare, class = typename C::is_transparent>
+  iterator upper_bound(const K& key) const {
+    typename StatsPolicy::Scope scope(&stats_);
+    return Iterator::Bound(root_, key, true);
+  }
+
+  template <class K, class C = KeyCompare, class = typename C::is_transparent>
+  std::pair<iterator, iterator> equal_range(const K& key) const {
+    return std::make_pair(lower_bound(key), upper_bound(key));
+  }
+
+  // Calls fn(Comparable&) for every item with lo <= key <= hi in key order.
+  // Costs O(log n + k) for k visited items.
+  template <class Function>
+  void ForEachInRange(const KeyType& lo, const KeyType& hi,
+                      Function fn) const {
+    for (iterator it = lower_bound(lo);
+         it != end() && KeyCompare()(hi, it->Key()) >= 0; ++it) {
+      fn(*it);
+    }
+  }
+
+  // Same as Validate().
+  bool IsBalanced() const {
+    return Validate();
+  }
+
+  // Checks every invariant in one O(n) pass: keys strictly increase in
+  // order, every balance factor is the difference of the real heights of
+  // the node's subtrees and at most 1, subtree sizes are right if kept,
+  // and Size() and Height() are right. The subtrees of the top levels are
+  // checked on up to threads threads. Never recurses on the thread's own
+  // stack, so a corrupt, arbitrarily deep tree is reported, not crashed
+  // on.
+  bool Validate(size_t threads = 1) const {
+    Checked checked = Check(root_, NULL, NULL, Forks(threads), size_);
+    return checked.ok && checked.count == size_ && checked.height == height_;
+  }
+
+  // Height of the tree, 0 if empty. Kept up to date by every write.
+  int Height() const {
+    return height_;
   }
 
   bool IsEmpty() const {
     return root_ == NULL;
   }
 
+  size_t Size() const {
+    return size_;
+  }
+
+  // What the tree has done since it was built or ResetStats() was last
+  // called, with its current height and size. Requires AVLOperationStats.
+  AVLStats Stats() const {
+    static_assert(StatsPolicy::kEnabled, "Stats needs AVLOperationStats");
+    AVLStats stats;
+    stats_.Read(&stats);
+    stats.height = height_;
+    stats.size = size_;
+    return stats;
+  }
+
+  void ResetStats() {
+    static_assert(StatsPolicy::kEnabled, "Stats needs AVLOperationStats");
+    stats_.Reset();
+  }
+
+  // Number of keys less than key. Requires AVLSubtreeSize.
+  size_t Rank(const KeyType& key) const {
+    return CountBelow(key, false);
+  }
+
+  // The item with k keys before it, or NULL if k >= Size(). Requires
+  // AVLSubtreeSize.
+  Comparable* Select(size_t k) const {
+    static_assert(SizePolicy::kEnabled, "Select needs AVLSubtreeSize");
+    Node* n = root_;
+    while (n) {
+      size_t left = Node::Count(n->Left());
+      if (k < left) {
+        n = n->Left();
+      } else if (k == left) {
+        return n;
+      } else {
+        k -= left + 1;
+        n = n->Right();
+      }
+    }
+    return NULL;
+  }
+
+  // Number of keys with lo <= key <= hi. Requires AVLSubtreeSize.
+  size_t CountInRange(const KeyType& lo, const KeyType& hi) const {
+    if (KeyCompare()(hi, lo) < 0) {
+      return 0;
+    }
+    return CountBelow(hi, true) - CountBelow(lo, false);
+  }
+
+  // AggregatePolicy::Combine() of the values with lo <= key <= hi, in key
+  // order, or Identity() if there are none. Takes O(log n): below the
+  // node where the paths to lo and hi part, whole subtrees inside the
+  // range contribute their cached summaries. Requires an AggregatePolicy.
+  // Values must change only through the tree, as by InsertOrAssign(),
+  // for the summaries to follow.
+  typename AggregatePolicy::Type Aggregate(const KeyType& lo,
+                                           const KeyType& hi) const {
+    static_assert(AggregatePolicy::kEnabled,
+                  "Aggregate needs an AggregatePolicy");
+    typedef AggregatePolicy A;
+    typename StatsPolicy::Scope scope(&stats_);
+    Node* split = root_;
+    while (split) {
+      if (split->Compare(lo) == kMaxCmp) {
+        split = split->Right();
+      } else if (split->Compare(hi) == kMinCmp) {
+        split = split->Left();
+      } else {
+        break;
+      }
+    }
+    if (split == NULL || KeyCompare()(hi, lo) < 0) {
+      return A::Identity();
+    }
+    // Nodes not less than lo on the way down the left side come before
+    // everything gathered so far, together with their right subtrees.
+    typename A::Type below = A::Identity();
+    for (Node* n = split->Left(); n;) {
+      CompareResult result = n->Compare(lo);
+      if (result == kMaxCmp) {
+        n = n->Right();
+        continue;
+      }
+      below = A::Combine(Summary(n->Right()), below);
+      below = A::Combine(Node::Lift(n), below);
+      n = (result == kEqCmp) ? NULL : n->Left();
+    }
+    typename A::Type above = A::Identity();
+    for (Node* n = split->Right(); n;) {
+      CompareResult result = n->Compare(hi);
+      if (result == kMinCmp) {
+        n = n->Left();
+        continue;
+      }
+      above = A::Combine(above, Summary(n->Left()));
+      above = A::Combine(above, Node::Lift(n));
+      n = (result == kEqCmp) ? NULL : n->Right();
+    }
+    return A::Combine(A::Combine(below, Node::Lift(split)), above);
+  }
+
  private:
+  static typename AggregatePolicy::Type Summary(const Node* n) {
+    return n ? n->SubtreeAggregate() : AggregatePolicy::Identity();
+  }
+
+  // Refreshes the aggregates on the path to key after its value changed
+  // in place.
+  void RefreshAggregates(const KeyType& key) {
+    if (!AggregatePolicy::kEnabled) {
+      return;
+    }
+    typename Node::Path path;
+    for (Node** link = &root_; *link;) {
+      CompareResult result = (*link)->Compare(key);
+      path.Push(link, kLeft);
+      if (result == kEqCmp) {
+        break;
+      }
+      link = &(*link)->children[(result == kMinCmp) ? kLeft : kRight];
+    }
+    Node::UpdateAncestors(path);
+  }
+
   enum HeightEffect {
     kHeightNoChange = 0,
     kHeightChange = 1
   };
 
-  int Height(Node* n) const {
-    if (n == NULL) {
-      return 0;
+  template <class RandomIt>
+  struct SortedBuilder {
+    // Builds items [lo, hi) into a perfectly balanced subtree and stores
+    // its height. The top forks levels build their left half on a new
+    // thread.
+    Node* Build(size_t lo, size_t hi, int forks, int* height) const {
+      if (lo == hi) {
+        *height = 0;
+        return NULL;
+      }
+      size_t mid = lo + (hi - lo) / 2;
+      void* storage = block ? static_cast<void*>(block + mid)
+          : pool->Allocate();
+      Node* n = new(storage) Node(first[mid].first, first[mid].second);
+      int left_height;
+      int right_height;
+      if (forks > 0) {
+        std::thread left([&]() {
+          n->children[kLeft] = Build(lo, mid, forks - 1, &left_height);
+        });
+        n->children[kRight] = Build(mid + 1, hi, forks - 1, &right_height);
+        left.join();
+      } else {
+        n->children[kLeft] = Build(lo, mid, 0, &left_height);
+        n->children[kRight] = Build(mid + 1, hi, 0, &right_height);
+      }
+      n->balance_factor = static_cast<int8_t>(right_height - left_height);
+      n->Update();
+      *height = Node::max(left_height, right_height) + 1;
+      return n;
+    }
+
+    RandomIt first;
+    Node* block;
+    NodeAllocator* pool;
+  };
+
+  // Number of levels of a recursion to fork so that it runs on up to
+  // threads threads.
+  static int Forks(size_t threads) {
+    int forks = 0;
+    while ((static_cast<size_t>(2) << forks) <= threads) {
+      forks++;
     }
-    int l = Height(n->Left());
-    int r = Height(n->Right());
-    return Node::max(l, r) + 1;
+    return forks;
+  }
+
+  enum SetOperation {
+    kUnion,
+    kIntersection,
+    kDifference
+  };
+
+  // Subtrees shorter than this are merged on the thread at hand.
+  enum {
+    kMinForkHeight = 12
+  };
+
+  // Divide and conquer on Node::Split() and Node::Join(): split one tree
+  // around the root of the other, merge the two pairs of halves, and join
+  // the results around the root if it stays. Nodes are only relinked, so
+  // threads never touch the pool; the ones that leave both trees go to
+  // garbage, whose subtrees the caller frees.
+  struct Merger {
+    Node* Merge(Node* a, int a_height, Node* b, int b_height, int forks,
+                int* height, std::vector<Node*>* garbage) const {
+      if (a == NULL || b == NULL) {
+        Node* kept = (op == kUnion) ? (a ? a : b)
+            : (op == kDifference) ? a : NULL;
+        Node* dropped = (kept == a) ? b : a;
+        if (dropped) {
+          garbage->push_back(dropped);
+        }
+        *height = (kept == a) ? a_height : b_height;
+        return kept;
+      }
+      // Difference keeps items of a, so it splits a and drops b's root.
+      // The others keep a's root if it stays and drop b's copy of it.
+      Node* root = (op == kDifference) ? b : a;
+      int root_height = (op == kDifference) ? b_height : a_height;
+      Node* split = (op == kDifference) ? a : b;
+      int split_height = (op == kDifference) ? a_height : b_height;
+      Node* root_left = root->Left();
+      Node* root_right = root->Right();
+      int root_left_height = Node::ChildHeight(root, root_height, kLeft);
+      int root_right_height = Node::ChildHeight(root, root_height, kRight);
+      Node* left;
+      Node* found;
+      Node* right;
+      int left_height;
+      int right_height;
+      Node::Split(split, split_height, root->Key(), &left, &left_height,
+                  &found, &right, &right_height);
+      bool keep_root = op == kUnion || (op == kIntersection && found);
+      if (found) {
+        garbage->push_back(found);
+      }
+      if (!keep_root) {
+        root->children[kLeft] = root->children[kRight] = NULL;
+        garbage->push_back(root);
+      }
+      if (op == kDifference) {
+        std::swap(left, root_left);
+        std::swap(left_height, root_left_height);
+        std::swap(right, root_right);
+        std::swap(right_height, root_right_height);
+      }
+      // Now root_left and root_right are the halves of a.
+      if (forks > 0 && root_height >= kMinForkHeight) {
+        std::vector<Node*> left_garbage;
+        std::thread left_thread([&]() {
+          left = Merge(root_left, root_left_height, left, left_height,
+                       forks - 1, &left_height, &left_garbage);
+        });
+        right = Merge(root_right, root_right_height, right, right_height,
+                      forks - 1, &right_height, garbage);
+        left_thread.join();
+        garbage->insert(garbage->end(), left_garbage.begin(),
+                        left_garbage.end());
+      } else {
+        left = Merge(root_left, root_left_height, left, left_height, 0,
+                     &left_height, garbage);
+        right = Merge(root_right, root_right_height, right, right_height, 0,
+                      &right_height, garbage);
+      }
+      if (keep_root) {
+        return Node::Join(left, left_height, root, right, right_height,
+                          height);
+      }
+      return Node::Join(left, left_height, right, right_height, height);
+    }
+
+    SetOperation op;
+  };
+
+  void Merge(SetOperation op, AVLTree* other, size_t threads) {
+    typename StatsPolicy::Scope scope(&stats_);
+    pool_.Absorb(&other->pool_);
+    Merger merger;
+    merger.op = op;
+    std::vector<Node*> garbage;
+    root_ = merger.Merge(root_, height_, other->root_, other->height_,
+                         Forks(threads), &height_, &garbage);
+    size_t dropped = 0;
+    for (size_t i = 0; i < garbage.size(); i++) {
+      dropped += Node::DestroyTree(garbage[i], pool_);
+    }
+    size_ = size_ + other->size_ - dropped;
+    other->root_ = NULL;
+    other->size_ = 0;
+    other->height_ = 0;
+  }
+
+  // Batches smaller than this are split on the thread at hand.
+  enum {
+    kMinForkBatch = 4096
+  };
+
+  // Indices of m batch items in key order, keeping only the last of each
+  // run of equal keys. key(i) is the key of item i.
+  template <class KeyOf>
+  static std::vector<size_t> SortBatch(size_t m, KeyOf key) {
+    std::vector<size_t> order(m);
+    bool sorted = true;
+    for (size_t i = 0; i < m; i++) {
+      order[i] = i;
+      if (i > 0 && KeyCompare()(key(i - 1), key(i)) >= 0) {
+        sorted = false;
+      }
+    }
+    if (sorted) {
+      return order;
+    }
+    // Ties go by index, so the last of equal keys sorts last.
+    std::sort(order.begin(), order.end(), [&key](size_t a, size_t b) {
+      int result = KeyCompare()(key(a), key(b));
+      return result < 0 || (result == 0 && a < b);
+    });
+    size_t kept = 0;
+    for (size_t i = 0; i < m; i++) {
+      if (i + 1 < m && KeyCompare()(key(order[i]), key(order[i + 1])) == 0) {
+        continue;
+      }
+      order[kept++] = order[i];
+    }
+    order.resize(kept);
+    return order;
+  }
+
+  // Position of the first of the batch items [lo, hi) whose key is not
+  // less than n's. key(i) is the key of the i-th item in order.
+  template <class KeyOf>
+  static size_t BatchLowerBound(const Node* n, size_t lo, size_t hi,
+                                KeyOf key) {
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (KeyCompare()(key(mid), n->Key()) < 0) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+
+  template <class RandomIt>
+  struct BatchInserter {
+    const KeyType& KeyAt(size_t i) const {
+      return first[order[i]].first;
+    }
+
+    // Adds the items order[lo, hi) to the subtree at n, which is height
+    // tall, and returns the new subtree, storing its height in
+    // *new_height and adding the number of new nodes to *added.
+    Node* Insert(Node* n, int height, size_t lo, size_t hi, int forks,
+                 int* new_height, size_t* added) {
+      if (lo == hi) {
+        *new_height = height;
+        return n;
+      }
+      if (n == NULL) {
+        *added += hi - lo;
+        return Build(lo, hi, new_height);
+      }
+      size_t mid = BatchLowerBound(n, lo, hi, [this](size_t i)
+                                   -> const KeyType& { return KeyAt(i); });
+      size_t right_lo = mid;
+      if (mid < hi && n->Compare(KeyAt(mid)) == kEqCmp) {
+        n->SetValue(first[order[mid]].second);
+        right_lo++;
+      }
+      Node* left = n->Left();
+      Node* right = n->Right();
+      int left_height = Node::ChildHeight(n, height, kLeft);
+      int right_height = Node::ChildHeight(n, height, kRight);
+      if (forks > 0 && hi - lo >= kMinForkBatch) {
+        size_t left_added = 0;
+        std::thread left_thread([&]() {
+          left = Insert(left, left_height, lo, mid, forks - 1, &left_height,
+                        &left_added);
+        });
+        right = Insert(right, right_height, right_lo, hi, forks - 1,
+                       &right_height, added);
+        left_thread.join();
+        *added += left_added;
+      } else {
+        left = Insert(left, left_height, lo, mid, 0, &left_height, added);
+        right = Insert(right, right_height, right_lo, hi, 0, &right_height,
+                       added);
+      }
+      return Node::Join(left, left_height, n, right, right_height,
+                        new_height);
+    }
+
+    // Builds items order[lo, hi) into a perfectly balanced subtree.
+    Node* Build(size_t lo, size_t hi, int* height) {
+      if (lo == hi) {
+        *height = 0;
+        return NULL;
+      }
+      size_t mid = lo + (hi - lo) / 2;
+      size_t item = order[mid];
+      void* storage;
+      if (slots.empty()) {
+        storage = pool->Allocate();
+      } else {
+        storage = slots[item];
+        slots[item] = NULL;
+      }
+      Node* n = new(storage) Node(first[item].first, first[item].second);
+      int left_height;
+      int right_height;
+      n->children[kLeft] = Build(lo, mid, &left_height);
+      n->children[kRight] = Build(mid + 1, hi, &right_height);
+      n->balance_factor = static_cast<int8_t>(right_height - left_height);
+      n->Update();
+      *height = Node::max(left_height, right_height) + 1;
+      return n;
+    }
+
+    RandomIt first;
+    std::vector<size_t> order;
+    NodeAllocator* pool;
+    // Storage for each item's node when forked; taken slots are NULL.
+    std::vector<void*> slots;
+  };
+
+  template <class RandomIt>
+  struct BatchRemover {
+    const KeyType& KeyAt(size_t i) const {
+      return first[order[i]];
+    }
+
+    // Removes the keys order[lo, hi) from the subtree at n, which is
+    // height tall, and returns the new subtree, storing its height in
+    // *new_height. Unlinked nodes go to garbage.
+    Node* Remove(Node* n, int height, size_t lo, size_t hi, int forks,
+                 int* new_height, std::vector<Node*>* garbage) const {
+      if (lo == hi || n == NULL) {
+        *new_height = height;
+        return n;
+      }
+      size_t mid = BatchLowerBound(n, lo, hi, [this](size_t i)
+                                   -> const KeyType& { return KeyAt(i); });
+      bool found = mid < hi && n->Compare(KeyAt(mid)) == kEqCmp;
+      Node* left = n->Left();
+      Node* right = n->Right();
+      int left_height = Node::ChildHeight(n, height, kLeft);
+      int right_height = Node::ChildHeight(n, height, kRight);
+      size_t right_lo = found ? mid + 1 : mid;
+      if (forks > 0 && hi - lo >= kMinForkBatch) {
+        std::vector<Node*> left_garbage;
+        std::thread left_thread([&]() {
+          left = Remove(left, left_height, lo, mid, forks - 1, &left_height,
+                        &left_garbage);
+        });
+        right = Remove(right, right_height, right_lo, hi, forks - 1,
+                       &right_height, garbage);
+        left_thread.join();
+        garbage->insert(garbage->end(), left_garbage.begin(),
+                        left_garbage.end());
+      } else {
+        left = Remove(left, left_height, lo, mid, 0, &left_height, garbage);
+        right = Remove(right, right_height, right_lo, hi, 0, &right_height,
+                       garbage);
+      }
+      if (found) {
+        garbage->push_back(n);
+        return Node::Join(left, left_height, right, right_height,
+                          new_height);
+      }
+      return Node::Join(left, left_height, n, right, right_height,
+                        new_height);
+    }
+
+    RandomIt first;
+    std::vector<size_t> order;
+  };
+
+  // Number of keys less than key, or not greater than key if
+  // include_equal is set.
+  size_t CountBelow(const KeyType& key, bool include_equal) const {
+    typename StatsPolicy::Scope scope(&stats_);
+    static_assert(SizePolicy::kEnabled, "Rank needs AVLSubtreeSize");
+    size_t count = 0;
+    for (Node* n = root_; n;) {
+      CompareResult result = n->Compare(key);
+      if (result == kMinCmp || (result == kEqCmp && !include_equal)) {
+        n = n->Left();
+      } else {
+        count += Node::Count(n->Left()) + 1;
+        n = n->Right();
+      }
+    }
+    return count;
+  }
+
+  // Keeps height_ up to date across one write. A write changes one side
+  // of the root only, so the height can only have changed if the root or
+  // its balance factor did, and then it is read off again in O(log n).
+  class HeightUpdate {
+   public:
+    explicit HeightUpdate(AVLTree* tree) :
+        tree_(tree),
+        root_(tree->root_),
+        balance_factor_(root_ ? root_->balance_factor
+                              : static_cast<int8_t>(kE)) {
+    }
+
+    ~HeightUpdate() {
+      Node* root = tree_->root_;
+      if (root != root_ || (root && root->balance_factor != balance_factor_)) {
+        tree_->height_ = Node::Height(root);
+      }
+    }
+
+   private:
+    AVLTree* tree_;
+    Node* root_;
+    int8_t balance_factor_;
+
+    HeightUpdate(const HeightUpdate&);
+    HeightUpdate& operator=(const HeightUpdate&);
+  };
+
+  struct Checked {
+    bool ok;
+    int height;
+    size_t count;
+  };
+
+  // Checks the subtree at n, whose keys must lie strictly between *lo and
+  // *hi where those are not NULL, and which must have at most limit
+  // nodes, so that a cycle is reported too. The top forks levels check
+  // their left subtree on a new thread.
+  static Checked Check(const Node* n, const KeyType* lo, const KeyType* hi,
+                       int forks, size_t limit) {
+    if (forks == 0 || n == NULL) {
+      return CheckWithStack(n, lo, hi, limit);
+    }
+    Checked checked = {InRange(n, lo, hi), 0, 0};
+    if (!checked.ok) {
+      return checked;
+    }
+    Checked left;
+    std::thread left_thread([&]() {
+      left = Check(n->Left(), lo, &n->Key(), forks - 1, limit);
+    });
+    Checked right = Check(n->Right(), &n->Key(), hi, forks - 1, limit);
+    left_thread.join();
+    return Combine(n, left, right);
+  }
+
+  // Check() without forks, as a post-order walk on an explicit stack.
+  // Children's results are pushed on done and combined at their parent.
+  static Checked CheckWithStack(const Node* root, const KeyType* lo,
+                                const KeyType* hi, size_t limit) {
+    struct Frame {
+      const Node* n;
+      const KeyType* lo;
+      const KeyType* hi;
+      bool expanded;
+    };
+    Checked failed = {false, 0, 0};
+    std::vector<Frame> stack;
+    std::vector<Checked> done;
+    Frame first = {root, lo, hi, false};
+    stack.push_back(first);
+    size_t visited = 0;
+    while (!stack.empty()) {
+      Frame f = stack.back();
+      if (f.n == NULL) {
+        Checked empty = {true, 0, 0};
+        done.push_back(empty);
+        stack.pop_back();
+      } else if (!f.expanded) {
+        if (!InRange(f.n, f.lo, f.hi) || ++visited > limit) {
+          return failed;
+        }
+        stack.back().expanded = true;
+        Frame right = {f.n->Right(), &f.n->Key(), f.hi, false};
+        Frame left = {f.n->Left(), f.lo, &f.n->Key(), false};
+        stack.push_back(right);
+        stack.push_back(left);
+      } else {
+        stack.pop_back();
+        Checked right = done.back();
+        done.pop_back();
+        Checked left = done.back();
+        done.pop_back();
+        Checked checked = Combine(f.n, left, right);
+        if (!checked.ok) {
+          return failed;
+        }
+        done.push_back(checked);
+      }
+    }
+    return done.back();
+  }
+
+  static bool InRange(const Node* n, const KeyType* lo, const KeyType* hi) {
+    return (lo == NULL || KeyCompare()(*lo, n->Key()) < 0) &&
+        (hi == NULL || KeyCompare()(n->Key(), *hi) < 0);
+  }
+
+  // Checks n given the results for its subtrees.
+  static Checked Combine(const Node* n, const Checked& left,
+                         const Checked& right) {
+    Checked checked = {left.ok && right.ok,
+                       Node::max(left.height, right.height) + 1,
+                       left.count + right.count + 1};
+    int diff = right.height - left.height;
+    if (diff != n->balance_factor || diff < kL || diff > kR ||
+        (SizePolicy::kEnabled && n->SubtreeSize() != checked.count) ||
+        !n->AggregateIsCurrent(n)) {
+      checked.ok = false;
+    }
+    return checked;
   }
 
   Node* root_;
+  size_t size_;
+  int height_;
+  NodeAllocator pool_;
+  StatsPolicy stats_;
+
+  AVLTree(const AVLTree&);
+  AVLTree& operator=(const AVLTree&);
 };
 
 #endif  // AVL_TREE_H_
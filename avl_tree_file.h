@@ -0,0 +1,484 @@
+/*
+ *   Copyright (c) 2011 Higepon(Taro Minowa) <higepon@users.sourceforge.jp>
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *   TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ *   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ *   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef AVL_TREE_FILE_H_
+#define AVL_TREE_FILE_H_
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "./avl_tree.h"
+
+// Image files written by SaveAVLTree() hold a 64-byte header followed by
+// every item in key order. Trivially copyable items are stored as an
+// array of AVLFileRecord, which MappedAVLTree searches in place; other
+// items are stored one after another through AVLSerializer. The checksum
+// is FNV-1a over everything after the header. Files are in the byte
+// order of the machine that wrote them.
+
+struct AVLFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  // sizeof(AVLFileRecord) if items are stored as records, else 0.
+  uint32_t record_size;
+  uint32_t key_size;
+  uint32_t value_size;
+  uint32_t reserved;
+  uint64_t count;
+  uint64_t payload_size;
+  uint64_t checksum;
+  char padding[8];
+};
+
+static_assert(sizeof(AVLFileHeader) == 64, "AVLFileHeader must be 64 bytes");
+
+static const char kAVLFileMagic[8] = {'A', 'V', 'L', 'T', 'R', 'E', 'E', 0};
+static const uint32_t kAVLFileVersion = 1;
+static const uint32_t kAVLFileByteOrder = 0x01020304;
+
+template <class KeyType, class ValueType> struct AVLFileRecord {
+  const KeyType& Key() const {
+    return key;
+  }
+
+  const ValueType& Value() const {
+    return value;
+  }
+
+  KeyType key;
+  ValueType value;
+};
+
+// FNV-1a, fed in pieces.
+class AVLFileChecksum {
+ public:
+  AVLFileChecksum() : hash_(14695981039346656037ULL) {}
+
+  void Update(const void* data, size_t size) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++) {
+      hash_ = (hash_ ^ p[i]) * 1099511628211ULL;
+    }
+  }
+
+  uint64_t Value() const {
+    return hash_;
+  }
+
+ private:
+  uint64_t hash_;
+};
+
+// Output to a buffered file, or appended to a string, that keeps count
+// and checksum of what it wrote.
+class AVLFileWriter {
+ public:
+  explicit AVLFileWriter(FILE* file) : file_(file), buffer_(NULL), size_(0) {}
+
+  explicit AVLFileWriter(std::string* buffer) :
+      file_(NULL),
+      buffer_(buffer),
+      size_(0) {
+  }
+
+  bool Write(const void* data, size_t size) {
+    checksum_.Update(data, size);
+    size_ += size;
+    if (buffer_) {
+      buffer_->append(static_cast<const char*>(data), size);
+      return true;
+    }
+    return fwrite(data, 1, size, file_) == size;
+  }
+
+  uint64_t Size() const {
+    return size_;
+  }
+
+  uint64_t Checksum() const {
+    return checksum_.Value();
+  }
+
+ private:
+  FILE* file_;
+  std::string* buffer_;
+  uint64_t size_;
+  AVLFileChecksum checksum_;
+};
+
+// Input from a buffered file or from memory that stops after size bytes.
+class AVLFileReader {
+ public:
+  AVLFileReader(FILE* file, uint64_t size) :
+      file_(file),
+      data_(NULL),
+      left_(size) {
+  }
+
+  AVLFileReader(const char* data, uint64_t size) :
+      file_(NULL),
+      data_(data),
+      left_(size) {
+  }
+
+  bool Read(void* data, size_t size) {
+    if (size > left_) {
+      return false;
+    }
+    if (data_) {
+      memcpy(data, data_, size);
+      data_ += size;
+    } else if (fread(data, 1, size, file_) != size) {
+      return false;
+    }
+    left_ -= size;
+    checksum_.Update(data, size);
+    return true;
+  }
+
+  uint64_t Left() const {
+    return left_;
+  }
+
+  uint64_t Checksum() const {
+    return checksum_.Value();
+  }
+
+ private:
+  FILE* file_;
+  const char* data_;
+  uint64_t left_;
+  AVLFileChecksum checksum_;
+};
+
+// How a key or value is stored when items are not saved as records. The
+// default copies the bytes of trivially copyable types; std::string is
+// stored as its length and characters. Specialize it for other types.
+template <class T, class Enable = void> struct AVLSerializer;
+
+template <class T>
+struct AVLSerializer<
+    T, typename std::enable_if<std::is_trivially_copyable<T>::value>::type> {
+  static bool Write(AVLFileWriter* out, const T& t) {
+    return out->Write(&t, sizeof(t));
+  }
+
+  static bool Read(AVLFileReader* in, T* t) {
+    return in->Read(t, sizeof(*t));
+  }
+};
+
+template <> struct AVLSerializer<std::string> {
+  static bool Write(AVLFileWriter* out, const std::string& s) {
+    uint64_t size = s.size();
+    return out->Write(&size, sizeof(size)) && out->Write(s.data(), s.size());
+  }
+
+  static bool Read(AVLFileReader* in, std::string* s) {
+    uint64_t size;
+    if (!in->Read(&size, sizeof(size)) || size > in->Left()) {
+      return false;
+    }
+    s->resize(size);
+    return size == 0 || in->Read(&(*s)[0], size);
+  }
+};
+
+template <class KeyType, class ValueType> struct AVLFileFormat {
+  typedef AVLFileRecord<KeyType, ValueType> Record;
+
+  static const bool kRecords = std::is_trivially_copyable<KeyType>::value &&
+      std::is_trivially_copyable<ValueType>::value;
+
+  static AVLFileHeader NewHeader(uint64_t count) {
+    AVLFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kAVLFileMagic, sizeof(header.magic));
+    header.version = kAVLFileVersion;
+    header.byte_order = kAVLFileByteOrder;
+    header.record_size = kRecords ? sizeof(Record) : 0;
+    header.key_size = sizeof(KeyType);
+    header.value_size = sizeof(ValueType);
+    header.count = count;
+    return header;
+  }
+
+  // True if header was written by SaveAVLTree() for these types.
+  static bool Matches(const AVLFileHeader& header) {
+    AVLFileHeader expected = NewHeader(header.count);
+    return memcmp(header.magic, expected.magic, sizeof(header.magic)) == 0 &&
+        header.version == expected.version &&
+        header.byte_order == expected.byte_order &&
+        header.record_size == expected.record_size &&
+        header.key_size == expected.key_size &&
+        header.value_size == expected.value_size &&
+        (!kRecords || header.payload_size == header.count * sizeof(Record));
+  }
+
+  static bool WriteItem(AVLFileWriter* out, const KeyType& key,
+                        const ValueType& value) {
+    if (kRecords) {
+      // Padding is zeroed so that equal trees give equal files.
+      Record record;
+      memset(static_cast<void*>(&record), 0, sizeof(record));
+      record.key = key;
+      record.value = value;
+      return out->Write(&record, sizeof(record));
+    }
+    return AVLSerializer<KeyType>::Write(out, key) &&
+        AVLSerializer<ValueType>::Write(out, value);
+  }
+
+  static bool ReadItem(AVLFileReader* in, KeyType* key, ValueType* value) {
+    if (kRecords) {
+      Record record;
+      if (!in->Read(&record, sizeof(record))) {
+        return false;
+      }
+      *key = record.key;
+      *value = record.value;
+      return true;
+    }
+    return AVLSerializer<KeyType>::Read(in, key) &&
+        AVLSerializer<ValueType>::Read(in, value);
+  }
+};
+
+// Writes every item of tree to path. The image is written to a temporary
+// file that replaces path only once it is complete, so a crash never
+// leaves a half-written image behind. Returns false on any I/O error.
+template <class KeyType, class ValueType, template <class> class Allocator,
+          class SizePolicy, class KeyCompare, class StatsPolicy,
+          class AggregatePolicy>
+bool SaveAVLTree(
+    const AVLTree<KeyType, ValueType, Allocator, SizePolicy, KeyCompare,
+                  StatsPolicy, AggregatePolicy>& tree,
+    const char* path) {
+  typedef AVLFileFormat<KeyType, ValueType> Format;
+  std::string temp_path = std::string(path) + ".tmp";
+  FILE* file = fopen(temp_path.c_str(), "wb");
+  if (file == NULL) {
+    return false;
+  }
+  AVLFileHeader header = Format::NewHeader(tree.Size());
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  AVLFileWriter out(file);
+  for (auto it = tree.begin(); ok && it != tree.end(); ++it) {
+    ok = Format::WriteItem(&out, it->Key(), it->Value());
+  }
+  if (ok) {
+    header.payload_size = out.Size();
+    header.checksum = out.Checksum();
+    ok = fseek(file, 0, SEEK_SET) == 0 &&
+        fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fflush(file) == 0 && fsync(fileno(file)) == 0;
+  }
+  ok = (fclose(file) == 0) && ok;
+  if (!ok || rename(temp_path.c_str(), path) != 0) {
+    remove(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Replaces the contents of tree with the image at path in O(n), using
+// BuildFromSorted(). Returns false, leaving tree unchanged, if the file
+// cannot be read, was written for other types, fails its checksum or is
+// not in key order.
+template <class KeyType, class ValueType, template <class> class Allocator,
+          class SizePolicy, class KeyCompare, class StatsPolicy,
+          class AggregatePolicy>
+bool LoadAVLTree(
+    const char* path,
+    AVLTree<KeyType, ValueType, Allocator, SizePolicy, KeyCompare,
+            StatsPolicy, AggregatePolicy>* tree) {
+  typedef AVLFileFormat<KeyType, ValueType> Format;
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) {
+    return false;
+  }
+  AVLFileHeader header;
+  struct stat st;
+  bool ok = fstat(fileno(file), &st) == 0 &&
+      fread(&header, sizeof(header), 1, file) == 1 &&
+      Format::Matches(header) &&
+      header.payload_size == st.st_size - sizeof(header);
+  std::vector<std::pair<KeyType, ValueType> > items;
+  if (ok) {
+    AVLFileReader in(file, header.payload_size);
+    if (Format::kRecords) {
+      items.reserve(header.count);
+    }
+    for (uint64_t i = 0; ok && i < header.count; i++) {
+      items.push_back(std::pair<KeyType, ValueType>());
+      ok = Format::ReadItem(&in, &items.back().first, &items.back().second) &&
+          (i == 0 || KeyCompare()(items[i - 1].first, items[i].first) < 0);
+    }
+    ok = ok && in.Left() == 0 && in.Checksum() == header.checksum;
+  }
+  fclose(file);
+  if (!ok) {
+    return false;
+  }
+  tree->BuildFromSorted(items.begin(), items.end());
+  return true;
+}
+
+// Read-only view of an image written by SaveAVLTree() for trivially
+// copyable keys and values. The file is mapped into memory and searched
+// in place by binary search, so opening it costs no deserialization and
+// pages are read from disk only as lookups touch them. POSIX only.
+template <class KeyType, class ValueType,
+          class KeyCompare = AVLDefaultCompare>
+class MappedAVLTree {
+ public:
+  typedef AVLFileRecord<KeyType, ValueType> Record;
+
+  MappedAVLTree() : map_(NULL), map_size_(0), records_(NULL), count_(0) {}
+
+  ~MappedAVLTree() {
+    Close();
+  }
+
+  // Maps the image at path. With verify set the whole file is read once
+  // to check its checksum. Returns false if the file cannot be mapped or
+  // is not a valid image for these types.
+  bool Open(const char* path, bool verify = true) {
+    static_assert(AVLFileFormat<KeyType, ValueType>::kRecords,
+                  "MappedAVLTree needs trivially copyable keys and values");
+    Close();
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 &&
+        static_cast<size_t>(st.st_size) >= sizeof(AVLFileHeader)) {
+      map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+      return false;
+    }
+    map_ = map;
+    map_size_ = st.st_size;
+    const AVLFileHeader* header = static_cast<const AVLFileHeader*>(map);
+    const char* payload = static_cast<const char*>(map) + sizeof(*header);
+    bool ok = AVLFileFormat<KeyType, ValueType>::Matches(*header) &&
+        header->payload_size == map_size_ - sizeof(*header);
+    if (ok && verify) {
+      AVLFileChecksum checksum;
+      checksum.Update(payload, header->payload_size);
+      ok = checksum.Value() == header->checksum;
+    }
+    if (!ok) {
+      Close();
+      return false;
+    }
+    records_ = reinterpret_cast<const Record*>(payload);
+    count_ = header->count;
+    return true;
+  }
+
+  void Close() {
+    if (map_) {
+      munmap(map_, map_size_);
+    }
+    map_ = NULL;
+    map_size_ = 0;
+    records_ = NULL;
+    count_ = 0;
+  }
+
+  const Record* Get(const KeyType& key) const {
+    size_t i = LowerBound(key);
+    if (i < count_ && KeyCompare()(key, records_[i].key) == 0) {
+      return &records_[i];
+    }
+    return NULL;
+  }
+
+  // The item with the largest key not greater than key, or NULL.
+  const Record* GetLowerNearest(const KeyType& key) const {
+    size_t lo = 0;
+    size_t hi = count_;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (KeyCompare()(key, records_[mid].key) < 0) {
+        hi = mid;
+      } else {
+        lo = mid + 1;
+      }
+    }
+    return lo ? &records_[lo - 1] : NULL;
+  }
+
+  size_t Size() const {
+    return count_;
+  }
+
+  bool IsEmpty() const {
+    return count_ == 0;
+  }
+
+ private:
+  // Index of the first record whose key is not less than key.
+  size_t LowerBound(const KeyType& key) const {
+    size_t lo = 0;
+    size_t hi = count_;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (KeyCompare()(records_[mid].key, key) < 0) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+
+  void* map_;
+  size_t map_size_;
+  const Record* records_;
+  size_t count_;
+
+  MappedAVLTree(const MappedAVLTree&);
+  MappedAVLTree& operator=(const MappedAVLTree&);
+};
+
+#endif  // AVL_TREE_FILE_H_
@@ -0,0 +1,1665 @@
+/*
+ *   Copyright (c) 2011  Higepon(Taro Minowa)  <higepon@users.sourceforge.jp>
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *   TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ *   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ *   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#include <benchmark/benchmark.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <new>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+#include "./avl_tree.h"
+#include "./avl_tree_file.h"
+#include "./concurrent_avl_tree.h"
+#include "./durable_avl_tree.h"
+#include "./frozen_avl_tree.h"
+#include "./frozen_blocked_avl_tree.h"
+#include "./interval_avl_tree.h"
+#include "./multi_avl_tree.h"
+#include "./sharded_avl_tree.h"
+
+// Counts every operator new in the process, so benchmarks can report
+// allocations per operation. Kept out of line so that GCC does not pair
+// the malloc and free it can see with new and delete in its callers.
+static std::atomic<uint64_t> allocations(0);
+static std::atomic<uint64_t> allocated_bytes(0);
+
+__attribute__((noinline)) void* operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+  void* p = malloc(size);
+  if (p == NULL) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+  free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+
+namespace {
+
+typedef AVLTree<int, int> IntAVLTree;
+typedef ShardedAVLTree<int, int> IntShardedAVLTree;
+
+static std::vector<int> SequentialKeys(int64_t n) {
+  std::vector<int> keys(n);
+  for (int64_t i = 0; i < n; i++) {
+    keys[i] = static_cast<int>(i);
+  }
+  return keys;
+}
+
+static std::vector<int> ShuffledKeys(int64_t n) {
+  std::vector<int> keys = SequentialKeys(n);
+  std::mt19937 rng(42);
+  std::shuffle(keys.begin(), keys.end(), rng);
+  return keys;
+}
+
+// The recursive Insert and Remove that AVLTree used before they were
+// made iterative, kept as the baseline for BM_AddSequential, BM_AddRandom
+// and BM_RemoveRandom. Each level hands back through change whether its
+// subtree's height changed. Nodes come from the same pool allocator.
+class RecursiveAVLTree {
+ public:
+  struct Node {
+    int key;
+    int value;
+    Node* children[2];
+    int8_t balance_factor;
+  };
+
+  RecursiveAVLTree() : root_(NULL) {}
+
+  Node* Root() const {
+    return root_;
+  }
+
+  void Add(int key, int value) {
+    int change;
+    Node* found = Insert(key, value, root_, change);
+    if (found) {
+      found->value = value;
+    }
+  }
+
+  bool Remove(int key) {
+    int change;
+    Node* n = Remove(key, root_, change, kEqCmp);
+    if (n == NULL) {
+      return false;
+    }
+    pool_.Free(n);
+    return true;
+  }
+
+ private:
+  enum { kLeft = 0, kRight = 1 };
+  enum { kMinCmp = -1, kEqCmp = 0, kMaxCmp = 1 };
+
+  // With cmp kMinCmp, finds the smallest node instead of key.
+  static int Compare(const Node* n, int key, int cmp) {
+    if (cmp == kMinCmp) {
+      return n->children[kLeft] ? kMinCmp : kEqCmp;
+    }
+    return (key == n->key) ? kEqCmp : ((key < n->key) ? kMinCmp : kMaxCmp);
+  }
+
+  static int RotateOnce(Node*& root, int dir) {  // NOLINT
+    int other = 1 - dir;
+    Node* old_root = root;
+    int change = root->children[other]->balance_factor != 0;
+    root = old_root->children[other];
+    old_root->children[other] = root->children[dir];
+    root->children[dir] = old_root;
+    old_root->balance_factor = -((dir == kLeft) ? --(root->balance_factor)
+                                 : ++(root->balance_factor));
+    return change;
+  }
+
+  static int RotateTwice(Node*& root, int dir) {  // NOLINT
+    int other = 1 - dir;
+    Node* old_root = root;
+    Node* old_other = root->children[other];
+    root = old_other->children[dir];
+    old_root->children[other] = root->children[dir];
+    root->children[dir] = old_root;
+    old_other->children[dir] = root->children[other];
+    root->children[other] = old_other;
+    root->children[kLeft]->balance_factor =
+        -std::max<int>(root->balance_factor, 0);
+    root->children[kRight]->balance_factor =
+        -std::min<int>(root->balance_factor, 0);
+    root->balance_factor = 0;
+    return 1;
+  }
+
+  // Returns 1 if a rotation made the subtree shorter.
+  static int ReBalance(Node*& root) {  // NOLINT
+    if (root->balance_factor < -1) {
+      return (root->children[kLeft]->balance_factor == 1)
+          ? RotateTwice(root, kRight) : RotateOnce(root, kRight);
+    }
+    if (root->balance_factor > 1) {
+      return (root->children[kRight]->balance_factor == -1)
+          ? RotateTwice(root, kLeft) : RotateOnce(root, kLeft);
+    }
+    return 0;
+  }
+
+  // Returns the existing node for key, or adds one and returns NULL.
+  Node* Insert(int key, int value, Node*& root, int& change) {  // NOLINT
+    if (root == NULL) {
+      root = new(pool_.Allocate()) Node{key, value, {NULL, NULL}, 0};
+      change = 1;
+      return NULL;
+    }
+    int result = Compare(root, key, kEqCmp);
+    if (result == kEqCmp) {
+      return root;
+    }
+    Node* found = Insert(key, value,
+                         root->children[(result == kMinCmp) ? kLeft : kRight],
+                         change);
+    if (found) {
+      return found;
+    }
+    int increase = result * change;
+    root->balance_factor += increase;
+    change = (increase && root->balance_factor) ? (1 - ReBalance(root)) : 0;
+    return NULL;
+  }
+
+  // Unlinks and returns the node for key, or NULL.
+  Node* Remove(int key, Node*& root, int& change, int cmp) {  // NOLINT
+    if (root == NULL) {
+      change = 0;
+      return NULL;
+    }
+    Node* found;
+    int decrease;
+    int result = Compare(root, key, cmp);
+    if (result != kEqCmp) {
+      found = Remove(key, root->children[(result == kMinCmp) ? kLeft : kRight],
+                     change, cmp);
+      if (found == NULL) {
+        return NULL;
+      }
+      decrease = result * change;
+    } else {
+      found = root;
+      if (root->children[kLeft] == NULL || root->children[kRight] == NULL) {
+        root = root->children[root->children[kRight] ? kRight : kLeft];
+        change = 1;
+        return found;
+      }
+      // Unlink the in-order successor and move it into root's place.
+      Node* successor = Remove(key, root->children[kRight], decrease,
+                               kMinCmp);
+      successor->children[kLeft] = root->children[kLeft];
+      successor->children[kRight] = root->children[kRight];
+      successor->balance_factor = root->balance_factor;
+      root = successor;
+    }
+    root->balance_factor -= decrease;
+    if (decrease) {
+      change = root->balance_factor ? ReBalance(root) : 1;
+    } else {
+      change = 0;
+    }
+    return found;
+  }
+
+  Node* root_;
+  AVLPoolAllocator<Node> pool_;
+
+  RecursiveAVLTree(const RecursiveAVLTree&);
+  RecursiveAVLTree& operator=(const RecursiveAVLTree&);
+};
+
+template <class Tree>
+static void AddAll(Tree* tree, const std::vector<int>& keys) {
+  for (size_t i = 0; i < keys.size(); i++) {
+    tree->Add(keys[i], keys[i]);
+  }
+}
+
+static void ReportAllocations(benchmark::State& state, uint64_t count,
+                              int64_t ops) {
+  state.counters["allocs_per_op"] = static_cast<double>(count) / ops;
+}
+
+template <class Tree>
+static void BM_AddSequential(benchmark::State& state) {
+  std::vector<int> keys = SequentialKeys(state.range(0));
+  for (auto _ : state) {
+    Tree tree;
+    AddAll(&tree, keys);
+    benchmark::DoNotOptimize(tree.Root());
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+template <class Tree>
+static void BM_AddRandom(benchmark::State& state) {
+  std::vector<int> keys = ShuffledKeys(state.range(0));
+  for (auto _ : state) {
+    Tree tree;
+    AddAll(&tree, keys);
+    benchmark::DoNotOptimize(tree.Root());
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+static void BM_BuildFromSorted(benchmark::State& state) {
+  std::vector<std::pair<int, int> > items;
+  for (int64_t i = 0; i < state.range(0); i++) {
+    items.push_back(std::make_pair(static_cast<int>(i), static_cast<int>(i)));
+  }
+  for (auto _ : state) {
+    IntAVLTree tree(items.begin(), items.end());
+    benchmark::DoNotOptimize(tree.Root());
+  }
+  state.SetItemsProcessed(state.iterations() * items.size());
+}
+
+template <class Tree>
+static void BM_RemoveRandom(benchmark::State& state) {
+  std::vector<int> keys = ShuffledKeys(state.range(0));
+  std::vector<int> order = ShuffledKeys(state.range(0));
+  for (auto _ : state) {
+    state.PauseTiming();
+    Tree* tree = new Tree;
+    AddAll(tree, keys);
+    state.ResumeTiming();
+    for (size_t i = 0; i < order.size(); i++) {
+      benchmark::DoNotOptimize(tree->Remove(order[i]));
+    }
+    state.PauseTiming();
+    delete tree;
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * order.size());
+}
+
+// Draws ranks in [0, n) with P(rank i) proportional to 1 / (i + 1)^theta,
+// by the method of Gray et al. that YCSB uses. Rank 0 is the hottest.
+class ZipfGenerator {
+ public:
+  ZipfGenerator(uint64_t n, double theta, uint32_t seed) :
+      n_(n),
+      theta_(theta),
+      zeta_n_(Zeta(n, theta)),
+      alpha_(1 / (1 - theta)),
+      eta_((1 - pow(2.0 / n, 1 - theta)) / (1 - Zeta(2, theta) / zeta_n_)),
+      rng_(seed) {
+  }
+
+  uint64_t Next() {
+    double u = std::uniform_real_distribution<double>(0, 1)(rng_);
+    double uz = u * zeta_n_;
+    if (uz < 1) {
+      return 0;
+    }
+    if (uz < 1 + pow(0.5, theta_)) {
+      return 1;
+    }
+    uint64_t rank = static_cast<uint64_t>(n_ * pow(eta_ * u - eta_ + 1,
+                                                   alpha_));
+    return rank < n_ ? rank : n_ - 1;
+  }
+
+ private:
+  static double Zeta(uint64_t n, double theta) {
+    double sum = 0;
+    for (uint64_t i = 1; i <= n; i++) {
+      sum += 1 / pow(static_cast<double>(i), theta);
+    }
+    return sum;
+  }
+
+  uint64_t n_;
+  double theta_;
+  double zeta_n_;
+  double alpha_;
+  double eta_;
+  std::mt19937_64 rng_;
+};
+
+// YCSB's default skew.
+static const double kZipfTheta = 0.99;
+
+// Spreads the hot ranks over [0, n), so that they are not all neighbours.
+static int ScatterRank(uint64_t rank, int64_t n) {
+  return static_cast<int>((rank * 2654435761ULL) % n);
+}
+
+enum KeyOrder {
+  kSequentialOrder,
+  kRandomOrder,
+  kZipfOrder
+};
+
+// n keys in [0, n): ascending, shuffled, or Zipf-distributed with
+// repeats.
+static std::vector<int> WorkloadKeys(int64_t n, KeyOrder order) {
+  if (order == kSequentialOrder) {
+    return SequentialKeys(n);
+  }
+  if (order == kRandomOrder) {
+    return ShuffledKeys(n);
+  }
+  ZipfGenerator zipf(n, kZipfTheta, 42);
+  std::vector<int> keys(n);
+  for (int64_t i = 0; i < n; i++) {
+    keys[i] = ScatterRank(zipf.Next(), n);
+  }
+  return keys;
+}
+
+// The store interface the workloads below run against, so that AVLTree
+// can be compared with std::map on identical operations.
+template <class Tree> struct BasicAVLStore {
+  void Put(int key, int value) {
+    tree.Add(key, value);
+  }
+
+  bool Get(int key) const {
+    return tree.Get(key) != NULL;
+  }
+
+  bool GetLowerNearest(int key) const {
+    return tree.GetLowerNearest(key) != NULL;
+  }
+
+  bool Remove(int key) {
+    return tree.Remove(key);
+  }
+
+  size_t Size() const {
+    return tree.Size();
+  }
+
+  Tree tree;
+};
+
+typedef BasicAVLStore<IntAVLTree> AVLStore;
+// Counts comparisons, visits, rotations and allocations as it goes.
+typedef BasicAVLStore<AVLTree<int, int, AVLPoolAllocator, AVLNoSubtreeSize,
+                              AVLDefaultCompare, AVLOperationStats> >
+    AVLStatsStore;
+
+struct MapStore {
+  void Put(int key, int value) {
+    map[key] = value;
+  }
+
+  bool Get(int key) const {
+    return map.find(key) != map.end();
+  }
+
+  bool GetLowerNearest(int key) const {
+    std::map<int, int>::const_iterator it = map.upper_bound(key);
+    return it != map.begin();
+  }
+
+  bool Remove(int key) {
+    return map.erase(key) == 1;
+  }
+
+  size_t Size() const {
+    return map.size();
+  }
+
+  std::map<int, int> map;
+};
+
+// Times one in kLatencySampleEvery operations and reports the 50th and
+// 99th percentile in ns. Each sample includes two clock reads.
+class LatencySampler {
+ public:
+  enum {
+    kLatencySampleEvery = 16
+  };
+
+  LatencySampler() : count_(0) {}
+
+  template <class Function>
+  void Run(Function fn) {
+    if (count_++ % kLatencySampleEvery) {
+      fn();
+      return;
+    }
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    fn();
+    samples_.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count());
+  }
+
+  void Report(benchmark::State& state) {
+    if (samples_.empty()) {
+      return;
+    }
+    std::sort(samples_.begin(), samples_.end());
+    state.counters["p50_ns"] = samples_[samples_.size() / 2];
+    state.counters["p99_ns"] = samples_[samples_.size() * 99 / 100];
+  }
+
+ private:
+  uint64_t count_;
+  std::vector<double> samples_;
+};
+
+// A store loaded with the keys [0, n) in random order.
+template <class Store>
+static void LoadStore(Store* store, int64_t n) {
+  std::vector<int> keys = ShuffledKeys(n);
+  for (size_t i = 0; i < keys.size(); i++) {
+    store->Put(keys[i], keys[i]);
+  }
+}
+
+// Puts range(0) keys in KeyOrder range(1) into an empty store. Reports
+// allocations per put and requested bytes per distinct key.
+template <class Store>
+static void BM_Put(benchmark::State& state) {
+  std::vector<int> keys = WorkloadKeys(state.range(0),
+                                       static_cast<KeyOrder>(state.range(1)));
+  uint64_t count = 0;
+  uint64_t bytes = 0;
+  size_t entries = 0;
+  for (auto _ : state) {
+    Store* store = new Store;
+    uint64_t before = allocations.load();
+    uint64_t bytes_before = allocated_bytes.load();
+    for (size_t i = 0; i < keys.size(); i++) {
+      store->Put(keys[i], keys[i]);
+    }
+    count += allocations.load() - before;
+    bytes += allocated_bytes.load() - bytes_before;
+    entries += store->Size();
+    state.PauseTiming();
+    delete store;
+    state.ResumeTiming();
+  }
+  ReportAllocations(state, count, state.iterations() * keys.size());
+  state.counters["bytes_per_entry"] = static_cast<double>(bytes) / entries;
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+// Looks up random keys, half of them absent, in a store of range(0)
+// keys.
+template <class Store>
+static void BM_Get(benchmark::State& state) {
+  Store store;
+  LoadStore(&store, state.range(0));
+  std::mt19937 rng(7);
+  int bound = static_cast<int>(2 * state.range(0));
+  LatencySampler sampler;
+  for (auto _ : state) {
+    int key = static_cast<int>(rng() % bound);
+    sampler.Run([&]() { benchmark::DoNotOptimize(store.Get(key)); });
+  }
+  sampler.Report(state);
+  state.SetItemsProcessed(state.iterations());
+}
+
+template <class Store>
+static void BM_GetLowerNearest(benchmark::State& state) {
+  Store store;
+  LoadStore(&store, state.range(0));
+  std::mt19937 rng(7);
+  int bound = static_cast<int>(state.range(0));
+  LatencySampler sampler;
+  for (auto _ : state) {
+    int key = static_cast<int>(rng() % bound);
+    sampler.Run([&]() {
+      benchmark::DoNotOptimize(store.GetLowerNearest(key));
+    });
+  }
+  sampler.Report(state);
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Removes every key of a store of range(0) keys in random order.
+template <class Store>
+static void BM_Remove(benchmark::State& state) {
+  std::vector<int> order = ShuffledKeys(state.range(0));
+  std::reverse(order.begin(), order.end());
+  for (auto _ : state) {
+    state.PauseTiming();
+    Store* store = new Store;
+    LoadStore(store, state.range(0));
+    state.ResumeTiming();
+    for (size_t i = 0; i < order.size(); i++) {
+      benchmark::DoNotOptimize(store->Remove(order[i]));
+    }
+    state.PauseTiming();
+    delete store;
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * order.size());
+}
+
+// YCSB core workloads on a store of range(0) keys: range(1) percent of
+// the operations read a key and the rest update one, with Zipf-skewed
+// key popularity. 50 is workload A, 95 is B and 100 is C.
+template <class Store>
+static void BM_Ycsb(benchmark::State& state) {
+  int64_t n = state.range(0);
+  int read_percent = static_cast<int>(state.range(1));
+  Store store;
+  LoadStore(&store, n);
+  // Drawn up front, so that pow() calls are not timed.
+  ZipfGenerator zipf(n, kZipfTheta, 11);
+  std::vector<int> keys(1 << 20);
+  for (size_t i = 0; i < keys.size(); i++) {
+    keys[i] = ScatterRank(zipf.Next(), n);
+  }
+  std::mt19937 rng(13);
+  LatencySampler sampler;
+  size_t i = 0;
+  for (auto _ : state) {
+    int key = keys[i++ & (keys.size() - 1)];
+    if (static_cast<int>(rng() % 100) < read_percent) {
+      sampler.Run([&]() { benchmark::DoNotOptimize(store.Get(key)); });
+    } else {
+      sampler.Run([&]() { store.Put(key, key + 1); });
+    }
+  }
+  sampler.Report(state);
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Trees for merging: the even keys below 2n, and m keys spread over the
+// same range of which about half are also in the first tree.
+static void MakeMergeTrees(benchmark::State& state, IntAVLTree* tree,
+                           IntAVLTree* other) {
+  int64_t n = state.range(0);
+  int64_t m = state.range(1);
+  std::vector<std::pair<int, int> > items;
+  for (int64_t i = 0; i < n; i++) {
+    items.push_back(std::make_pair(static_cast<int>(2 * i), 0));
+  }
+  tree->BuildFromSorted(items.begin(), items.end());
+  items.clear();
+  for (int64_t i = 0; i < m; i++) {
+    int key = static_cast<int>(i * (2 * n / m) + (i & 1));
+    items.push_back(std::make_pair(key, 1));
+  }
+  other->BuildFromSorted(items.begin(), items.end());
+}
+
+// Union of range(0) and range(1) items on range(2) threads.
+static void BM_Union(benchmark::State& state) {
+  for (auto _ : state) {
+    state.PauseTiming();
+    IntAVLTree* tree = new IntAVLTree;
+    IntAVLTree other;
+    MakeMergeTrees(state, tree, &other);
+    state.ResumeTiming();
+    tree->Union(&other, state.range(2));
+    benchmark::DoNotOptimize(tree->Root());
+    state.PauseTiming();
+    delete tree;
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(1));
+}
+
+// The same union by adding the smaller tree's items one by one.
+static void BM_UnionAddLoop(benchmark::State& state) {
+  for (auto _ : state) {
+    state.PauseTiming();
+    IntAVLTree* tree = new IntAVLTree;
+    IntAVLTree other;
+    MakeMergeTrees(state, tree, &other);
+    state.ResumeTiming();
+    for (IntAVLTree::iterator it = other.begin(); it != other.end(); ++it) {
+      tree->TryEmplace(it->Key(), it->Value());
+    }
+    benchmark::DoNotOptimize(tree->Root());
+    state.PauseTiming();
+    delete tree;
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(1));
+}
+
+// Fills tree with the even keys below 2^21 and returns items for every
+// odd key in random order, so that each round can add range(0) of them
+// that are not in the tree, nor on paths the last round warmed.
+static std::vector<std::pair<int, int> > BatchItems(IntAVLTree* tree) {
+  const int kTreeKeys = 1 << 20;
+  std::vector<std::pair<int, int> > items;
+  for (int i = 0; i < kTreeKeys; i++) {
+    items.push_back(std::make_pair(2 * i, i));
+  }
+  tree->BuildFromSorted(items.begin(), items.end());
+  std::vector<int> keys = ShuffledKeys(kTreeKeys);
+  for (int i = 0; i < kTreeKeys; i++) {
+    items[i] = std::make_pair(2 * keys[i] + 1, keys[i]);
+  }
+  return items;
+}
+
+static std::vector<int> BatchKeys(
+    const std::vector<std::pair<int, int> >& items) {
+  std::vector<int> keys;
+  for (size_t i = 0; i < items.size(); i++) {
+    keys.push_back(items[i].first);
+  }
+  return keys;
+}
+
+// Adds batches of range(0) items to a 2^20 item tree on range(1)
+// threads, removing each batch again untimed.
+static void BM_AddBatch(benchmark::State& state) {
+  IntAVLTree tree;
+  std::vector<std::pair<int, int> > items = BatchItems(&tree);
+  std::vector<int> keys = BatchKeys(items);
+  size_t m = state.range(0);
+  size_t i = 0;
+  for (auto _ : state) {
+    tree.AddBatch(items.begin() + i, items.begin() + i + m, state.range(1));
+    state.PauseTiming();
+    tree.RemoveBatch(keys.begin() + i, keys.begin() + i + m);
+    i = (i + m) % items.size();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * m);
+}
+
+// Removes batches of range(0) keys from a 2^20 item tree on range(1)
+// threads, adding each batch first untimed.
+static void BM_RemoveBatch(benchmark::State& state) {
+  IntAVLTree tree;
+  std::vector<std::pair<int, int> > items = BatchItems(&tree);
+  std::vector<int> keys = BatchKeys(items);
+  size_t m = state.range(0);
+  size_t i = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    tree.AddBatch(items.begin() + i, items.begin() + i + m);
+    state.ResumeTiming();
+    tree.RemoveBatch(keys.begin() + i, keys.begin() + i + m,
+                     state.range(1));
+    i = (i + m) % items.size();
+  }
+  state.SetItemsProcessed(state.iterations() * m);
+}
+
+// The same rounds by looping over Add() and Remove().
+static void BM_AddLoop(benchmark::State& state) {
+  IntAVLTree tree;
+  std::vector<std::pair<int, int> > items = BatchItems(&tree);
+  std::vector<int> keys = BatchKeys(items);
+  size_t m = state.range(0);
+  size_t i = 0;
+  for (auto _ : state) {
+    for (size_t j = i; j < i + m; j++) {
+      tree.Add(items[j].first, items[j].second);
+    }
+    state.PauseTiming();
+    tree.RemoveBatch(keys.begin() + i, keys.begin() + i + m);
+    i = (i + m) % items.size();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * m);
+}
+
+static void BM_RemoveLoop(benchmark::State& state) {
+  IntAVLTree tree;
+  std::vector<std::pair<int, int> > items = BatchItems(&tree);
+  size_t m = state.range(0);
+  size_t i = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    tree.AddBatch(items.begin() + i, items.begin() + i + m);
+    state.ResumeTiming();
+    for (size_t j = i; j < i + m; j++) {
+      benchmark::DoNotOptimize(tree.Remove(items[j].first));
+    }
+    i = (i + m) % items.size();
+  }
+  state.SetItemsProcessed(state.iterations() * m);
+}
+
+static const int kLargeKeys = 10 * 1000 * 1000;
+
+// A tree built in random order, so that neighbouring keys live far apart
+// in memory. 10M nodes take 320MB, well beyond any last-level cache.
+static const IntAVLTree& LargeTree() {
+  static IntAVLTree* tree = NULL;
+  if (tree == NULL) {
+    tree = new IntAVLTree;
+    AddAll(tree, ShuffledKeys(kLargeKeys));
+  }
+  return *tree;
+}
+
+static const FrozenAVLTree<int, int>& LargeFrozenTree() {
+  static FrozenAVLTree<int, int>* frozen = NULL;
+  if (frozen == NULL) {
+    frozen = new FrozenAVLTree<int, int>(LargeTree());
+  }
+  return *frozen;
+}
+
+// Each iteration resolves the next state.range(0) keys of a shuffled
+// list of every key, so repeated batches do not hit a warm cache.
+static void BM_GetRandom(benchmark::State& state) {
+  const IntAVLTree& tree = LargeTree();
+  std::vector<int> keys = ShuffledKeys(kLargeKeys);
+  size_t batch = state.range(0);
+  size_t offset = 0;
+  for (auto _ : state) {
+    if (offset + batch > keys.size()) {
+      offset = 0;
+    }
+    for (size_t i = offset; i < offset + batch; i++) {
+      benchmark::DoNotOptimize(tree.Get(keys[i]));
+    }
+    offset += batch;
+  }
+  state.SetItemsProcessed(state.iterations() * batch);
+}
+
+// Keys of the 10M-key tree in a random walk whose steps go up to range(0)
+// keys either way, for workloads where each access lands near the last.
+static std::vector<int> NearbyKeys(benchmark::State& state) {
+  std::mt19937 rng(17);
+  std::uniform_int_distribution<int> step(-state.range(0), state.range(0));
+  std::vector<int> keys(1 << 20);
+  int key = kLargeKeys / 2;
+  for (size_t i = 0; i < keys.size(); i++) {
+    key = std::min(std::max(key + step(rng), 0), kLargeKeys - 1);
+    keys[i] = key;
+  }
+  return keys;
+}
+
+static void BM_GetNearby(benchmark::State& state) {
+  const IntAVLTree& tree = LargeTree();
+  std::vector<int> keys = NearbyKeys(state);
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(tree.Get(keys[i++ & (keys.size() - 1)]));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+static void BM_CursorSeekNearby(benchmark::State& state) {
+  // Seeks do not write to the tree.
+  IntAVLTree::Cursor cursor(const_cast<IntAVLTree*>(&LargeTree()));
+  std::vector<int> keys = NearbyKeys(state);
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(cursor.Seek(keys[i++ & (keys.size() - 1)]));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Appends range(0) increasing keys to a 2^20 item tree, as a time
+// series does, by Add() or, if range(1) is set, through a cursor.
+static void BM_AppendKeys(benchmark::State& state) {
+  const int kTreeKeys = 1 << 20;
+  std::vector<std::pair<int, int> > items;
+  for (int i = 0; i < kTreeKeys; i++) {
+    items.push_back(std::make_pair(i, i));
+  }
+  int n = static_cast<int>(state.range(0));
+  for (auto _ : state) {
+    state.PauseTiming();
+    IntAVLTree* tree = new IntAVLTree(items.begin(), items.end());
+    IntAVLTree::Cursor cursor(tree);
+    state.ResumeTiming();
+    for (int key = kTreeKeys; key < kTreeKeys + n; key++) {
+      if (state.range(1)) {
+        cursor.InsertHint(key, key);
+      } else {
+        tree->Add(key, key);
+      }
+    }
+    state.PauseTiming();
+    delete tree;
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+typedef AVLTree<int, int64_t> SeriesAVLTree;
+typedef AVLTree<int, int64_t, AVLPoolAllocator, AVLNoSubtreeSize,
+                AVLDefaultCompare, AVLNoStats, AVLSum<int64_t> > SumAVLTree;
+
+// A 2^20 item time series: one value per timestamp.
+template <class Tree>
+static void LoadSeries(Tree* tree) {
+  std::vector<std::pair<int, int64_t> > items;
+  for (int i = 0; i < (1 << 20); i++) {
+    items.push_back(std::make_pair(i, static_cast<int64_t>(i % 1000)));
+  }
+  tree->BuildFromSorted(items.begin(), items.end());
+}
+
+// Sums of windows of range(0) timestamps at random offsets, by scanning.
+static void BM_WindowSumScan(benchmark::State& state) {
+  IntAVLTree tree;
+  std::vector<std::pair<int, int> > items;
+  for (int i = 0; i < (1 << 20); i++) {
+    items.push_back(std::make_pair(i, i % 1000));
+  }
+  tree.BuildFromSorted(items.begin(), items.end());
+  std::vector<int> starts = ShuffledKeys((1 << 20) - state.range(0));
+  size_t i = 0;
+  for (auto _ : state) {
+    int lo = starts[i++ % starts.size()];
+    int64_t sum = 0;
+    tree.ForEachInRange(lo, lo + state.range(0) - 1,
+                        [&sum](const IntAVLTree::Comparable& item) {
+                          sum += item.Value();
+                        });
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// The same sums from the cached subtree sums.
+static void BM_WindowSumAggregate(benchmark::State& state) {
+  SumAVLTree tree;
+  LoadSeries(&tree);
+  std::vector<int> starts = ShuffledKeys((1 << 20) - state.range(0));
+  size_t i = 0;
+  for (auto _ : state) {
+    int lo = starts[i++ % starts.size()];
+    benchmark::DoNotOptimize(tree.Aggregate(lo, lo + state.range(0) - 1));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// What keeping the sums costs writers: overwrites of random timestamps.
+template <class Tree>
+static void BM_SeriesUpdate(benchmark::State& state) {
+  Tree tree;
+  LoadSeries(&tree);
+  std::vector<int> keys = ShuffledKeys(1 << 20);
+  size_t i = 0;
+  for (auto _ : state) {
+    int key = keys[i++ & (keys.size() - 1)];
+    tree.InsertOrAssign(key, key);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// range(0) reservations: starts spread 100 apart on average and lengths
+// up to 1000, so a point falls in about five of them.
+static std::vector<std::pair<int, int> > Reservations(
+    benchmark::State& state) {
+  std::mt19937 rng(19);
+  int64_t n = state.range(0);
+  std::uniform_int_distribution<int> starts(0, static_cast<int>(100 * n));
+  std::vector<std::pair<int, int> > intervals;
+  for (int64_t i = 0; i < n; i++) {
+    int lo = starts(rng);
+    int hi = lo + static_cast<int>(rng() % 1000);
+    intervals.push_back(std::make_pair(lo, hi));
+  }
+  return intervals;
+}
+
+// Reservations containing random points, keyed by start in a plain tree
+// and filtered from the first one on.
+static void BM_IntervalScan(benchmark::State& state) {
+  std::vector<std::pair<int, int> > intervals = Reservations(state);
+  AVLTree<std::pair<int, int>, int> tree;
+  for (size_t i = 0; i < intervals.size(); i++) {
+    tree.Add(intervals[i], static_cast<int>(i));
+  }
+  std::vector<int> points = ShuffledKeys(100 * state.range(0));
+  size_t i = 0;
+  for (auto _ : state) {
+    int point = points[i++ % points.size()];
+    size_t found = 0;
+    for (auto it = tree.begin(); it != tree.end() && it->Key().first <= point;
+         ++it) {
+      found += (point <= it->Key().second);
+    }
+    benchmark::DoNotOptimize(found);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+static void BM_IntervalOverlapping(benchmark::State& state) {
+  std::vector<std::pair<int, int> > intervals = Reservations(state);
+  IntervalAVLTree<int, int> tree;
+  for (size_t i = 0; i < intervals.size(); i++) {
+    tree.Add(intervals[i].first, intervals[i].second, static_cast<int>(i));
+  }
+  std::vector<int> points = ShuffledKeys(100 * state.range(0));
+  size_t i = 0;
+  for (auto _ : state) {
+    size_t found = 0;
+    tree.Overlapping(points[i++ % points.size()],
+                     [&found](const IntervalAVLTree<int, int>::Comparable&) {
+                       found++;
+                     });
+    benchmark::DoNotOptimize(found);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+static void BM_IntervalCountStabbing(benchmark::State& state) {
+  std::vector<std::pair<int, int> > intervals = Reservations(state);
+  IntervalAVLTree<int, int> tree;
+  for (size_t i = 0; i < intervals.size(); i++) {
+    tree.Add(intervals[i].first, intervals[i].second, static_cast<int>(i));
+  }
+  std::vector<int> points = ShuffledKeys(100 * state.range(0));
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        tree.CountStabbing(points[i++ % points.size()]));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Duplicate keys as one node per item.
+struct MultiStore {
+  void Add(int key, int value) {
+    tree.Add(key, value);
+  }
+
+  int64_t SumOf(int key) const {
+    int64_t sum = 0;
+    std::pair<MultiAVLTree<int, int>::iterator,
+              MultiAVLTree<int, int>::iterator> range = tree.EqualRange(key);
+    for (MultiAVLTree<int, int>::iterator it = range.first;
+         it != range.second; ++it) {
+      sum += it->Value();
+    }
+    return sum;
+  }
+
+  bool RemoveOne(int key) {
+    return tree.RemoveOne(key);
+  }
+
+  MultiAVLTree<int, int> tree;
+};
+
+// Duplicate keys as a heap-allocated vector of values per key.
+struct VectorPerKeyStore {
+  typedef AVLTree<int, std::vector<int> > Tree;
+
+  void Add(int key, int value) {
+    tree.TryEmplace(key).first->Value().push_back(value);
+  }
+
+  int64_t SumOf(int key) const {
+    int64_t sum = 0;
+    Tree::Comparable* item = tree.Get(key);
+    if (item) {
+      for (size_t i = 0; i < item->Value().size(); i++) {
+        sum += item->Value()[i];
+      }
+    }
+    return sum;
+  }
+
+  bool RemoveOne(int key) {
+    Tree::Comparable* item = tree.Get(key);
+    if (item == NULL) {
+      return false;
+    }
+    item->Value().erase(item->Value().begin());
+    if (item->Value().empty()) {
+      tree.Remove(key);
+    }
+    return true;
+  }
+
+  Tree tree;
+};
+
+// 2^18 item keys in random order with range(0) items per key on average.
+static std::vector<int> DuplicateKeys(benchmark::State& state) {
+  const int kItems = 1 << 18;
+  std::mt19937 rng(23);
+  std::uniform_int_distribution<int> keys(0, kItems / state.range(0) - 1);
+  std::vector<int> items(kItems);
+  for (int i = 0; i < kItems; i++) {
+    items[i] = keys(rng);
+  }
+  return items;
+}
+
+template <class Store>
+static void BM_DuplicateAdd(benchmark::State& state) {
+  std::vector<int> keys = DuplicateKeys(state);
+  uint64_t count = 0;
+  for (auto _ : state) {
+    Store* store = new Store;
+    uint64_t before = allocations.load();
+    for (size_t i = 0; i < keys.size(); i++) {
+      store->Add(keys[i], static_cast<int>(i));
+    }
+    count += allocations.load() - before;
+    state.PauseTiming();
+    delete store;
+    state.ResumeTiming();
+  }
+  ReportAllocations(state, count, state.iterations() * keys.size());
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+// Sums the values of random keys.
+template <class Store>
+static void BM_DuplicateEqualRange(benchmark::State& state) {
+  std::vector<int> keys = DuplicateKeys(state);
+  Store store;
+  for (size_t i = 0; i < keys.size(); i++) {
+    store.Add(keys[i], static_cast<int>(i));
+  }
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(store.SumOf(keys[i++ % keys.size()]));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Drains a loaded store one item at a time, oldest first per key.
+template <class Store>
+static void BM_DuplicateRemoveOne(benchmark::State& state) {
+  std::vector<int> keys = DuplicateKeys(state);
+  std::vector<int> order = keys;
+  std::mt19937 rng(29);
+  std::shuffle(order.begin(), order.end(), rng);
+  for (auto _ : state) {
+    state.PauseTiming();
+    Store* store = new Store;
+    for (size_t i = 0; i < keys.size(); i++) {
+      store->Add(keys[i], static_cast<int>(i));
+    }
+    state.ResumeTiming();
+    for (size_t i = 0; i < order.size(); i++) {
+      benchmark::DoNotOptimize(store->RemoveOne(order[i]));
+    }
+    state.PauseTiming();
+    delete store;
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * order.size());
+}
+
+// Validate() of the 10M-key tree on range(0) threads.
+static void BM_Validate(benchmark::State& state) {
+  const IntAVLTree& tree = LargeTree();
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(tree.Validate(state.range(0)));
+  }
+  state.SetItemsProcessed(state.iterations() * tree.Size());
+}
+
+static void BM_GetBatchRandom(benchmark::State& state) {
+  const IntAVLTree& tree = LargeTree();
+  std::vector<int> keys = ShuffledKeys(kLargeKeys);
+  size_t batch = state.range(0);
+  std::vector<IntAVLTree::Comparable*> out(batch);
+  size_t offset = 0;
+  for (auto _ : state) {
+    if (offset + batch > keys.size()) {
+      offset = 0;
+    }
+    tree.GetBatch(&keys[offset], batch, &out[0]);
+    benchmark::DoNotOptimize(&out[0]);
+    offset += batch;
+  }
+  state.SetItemsProcessed(state.iterations() * batch);
+}
+
+typedef FrozenBlockedAVLTree<int, int> IntBlockedAVLTree;
+
+static const IntBlockedAVLTree& LargeBlockedTree(
+    IntBlockedAVLTree::Isa isa) {
+  static IntBlockedAVLTree* blocked[IntBlockedAVLTree::kAVX2 + 1];
+  if (blocked[isa] == NULL) {
+    blocked[isa] = new IntBlockedAVLTree(LargeTree(), isa);
+  }
+  return *blocked[isa];
+}
+
+static void BM_FrozenGetRandom(benchmark::State& state) {
+  const FrozenAVLTree<int, int>& frozen = LargeFrozenTree();
+  std::vector<int> keys = ShuffledKeys(kLargeKeys);
+  size_t batch = state.range(0);
+  size_t offset = 0;
+  for (auto _ : state) {
+    if (offset + batch > keys.size()) {
+      offset = 0;
+    }
+    for (size_t i = offset; i < offset + batch; i++) {
+      benchmark::DoNotOptimize(frozen.Get(keys[i]));
+    }
+    offset += batch;
+  }
+  state.SetItemsProcessed(state.iterations() * batch);
+}
+
+// state.range(1) picks the instruction set, see FrozenBlockedAVLTree::Isa.
+static void BM_FrozenBlockedGetRandom(benchmark::State& state) {
+  IntBlockedAVLTree::Isa isa =
+      static_cast<IntBlockedAVLTree::Isa>(state.range(1));
+  const IntBlockedAVLTree& blocked = LargeBlockedTree(isa);
+  if (blocked.GetIsa() != isa) {
+    state.SkipWithError("instruction set not supported");
+    return;
+  }
+  std::vector<int> keys = ShuffledKeys(kLargeKeys);
+  size_t batch = state.range(0);
+  size_t offset = 0;
+  for (auto _ : state) {
+    if (offset + batch > keys.size()) {
+      offset = 0;
+    }
+    for (size_t i = offset; i < offset + batch; i++) {
+      benchmark::DoNotOptimize(blocked.Get(keys[i]));
+    }
+    offset += batch;
+  }
+  state.SetItemsProcessed(state.iterations() * batch);
+}
+
+// LargeTree() saved to a file once.
+static const char* LargeImagePath() {
+  static const char* path = NULL;
+  if (path == NULL) {
+    path = "/tmp/avl_tree_bench.img";
+    SaveAVLTree(LargeTree(), path);
+  }
+  return path;
+}
+
+// Restart path before images: add every key again.
+static void BM_RebuildWithAdd(benchmark::State& state) {
+  std::vector<int> keys = ShuffledKeys(kLargeKeys);
+  for (auto _ : state) {
+    IntAVLTree tree;
+    AddAll(&tree, keys);
+    benchmark::DoNotOptimize(tree.Root());
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+static void BM_SaveImage(benchmark::State& state) {
+  const IntAVLTree& tree = LargeTree();
+  for (auto _ : state) {
+    SaveAVLTree(tree, "/tmp/avl_tree_bench_save.img");
+  }
+  remove("/tmp/avl_tree_bench_save.img");
+  state.SetItemsProcessed(state.iterations() * tree.Size());
+}
+
+static void BM_LoadImage(benchmark::State& state) {
+  const char* path = LargeImagePath();
+  for (auto _ : state) {
+    IntAVLTree tree;
+    if (!LoadAVLTree(path, &tree)) {
+      state.SkipWithError("load failed");
+      break;
+    }
+    benchmark::DoNotOptimize(tree.Root());
+  }
+  state.SetItemsProcessed(state.iterations() * kLargeKeys);
+}
+
+// state.range(0) says whether to verify the checksum.
+static void BM_MapImage(benchmark::State& state) {
+  const char* path = LargeImagePath();
+  for (auto _ : state) {
+    MappedAVLTree<int, int> mapped;
+    if (!mapped.Open(path, state.range(0))) {
+      state.SkipWithError("open failed");
+      break;
+    }
+    benchmark::DoNotOptimize(mapped.Get(kLargeKeys / 2));
+  }
+}
+
+static void BM_MappedGetRandom(benchmark::State& state) {
+  MappedAVLTree<int, int> mapped;
+  mapped.Open(LargeImagePath());
+  std::vector<int> keys = ShuffledKeys(kLargeKeys);
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(mapped.Get(keys[i]));
+    i = (i + 1) % keys.size();
+  }
+}
+
+static DurableAVLTree<int, int>& SharedDurableTree() {
+  static DurableAVLTree<int, int>* store = NULL;
+  static std::once_flag once;
+  std::call_once(once, []() {
+    store = new DurableAVLTree<int, int>;
+    store->Open("/tmp/avl_tree_bench_wal");
+  });
+  return *store;
+}
+
+// Every Add waits for its record to be synced, so throughput beyond one
+// fsync per Add comes from group commit.
+static void BM_DurableAdd(benchmark::State& state) {
+  DurableAVLTree<int, int>& store = SharedDurableTree();
+  int key = state.thread_index() << 24;
+  for (auto _ : state) {
+    store.Add(key, key);
+    key++;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Longer than any small-string buffer, so every copy allocates.
+static std::vector<std::string> StringKeys(int64_t n) {
+  std::vector<int> ids = ShuffledKeys(n);
+  std::vector<std::string> keys(n);
+  for (int64_t i = 0; i < n; i++) {
+    keys[i] = "avl-tree-benchmark-key-" + std::to_string(ids[i]);
+  }
+  return keys;
+}
+
+// A key that is expensive to copy but allocates nothing.
+struct BigKey {
+  explicit BigKey(int id) : id(id) {
+    memset(payload, 0, sizeof(payload));
+  }
+
+  bool operator==(const BigKey& other) const {
+    return id == other.id;
+  }
+
+  bool operator<(const BigKey& other) const {
+    return id < other.id;
+  }
+
+  int64_t id;
+  char payload[248];
+};
+
+static void BM_StringGet(benchmark::State& state) {
+  std::vector<std::string> keys = StringKeys(state.range(0));
+  AVLTree<std::string, int> tree;
+  for (size_t i = 0; i < keys.size(); i++) {
+    tree.Add(keys[i], static_cast<int>(i));
+  }
+  size_t i = 0;
+  uint64_t before = allocations.load();
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(tree.Get(keys[i]));
+    i = (i + 1) % keys.size();
+  }
+  ReportAllocations(state, allocations.load() - before, state.iterations());
+}
+
+// Add() copies the key and the value into the node.
+static void BM_StringAdd(benchmark::State& state) {
+  std::vector<std::string> keys = StringKeys(state.range(0));
+  uint64_t count = 0;
+  for (auto _ : state) {
+    AVLTree<std::string, std::string> tree;
+    uint64_t before = allocations.load();
+    for (size_t i = 0; i < keys.size(); i++) {
+      tree.Add(keys[i], keys[i]);
+    }
+    count += allocations.load() - before;
+  }
+  ReportAllocations(state, count, state.iterations() * keys.size());
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+// TryEmplace() moves both strings into the node.
+static void BM_StringTryEmplace(benchmark::State& state) {
+  std::vector<std::string> keys = StringKeys(state.range(0));
+  uint64_t count = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    std::vector<std::string> moved_keys(keys);
+    std::vector<std::string> moved_values(keys);
+    state.ResumeTiming();
+    AVLTree<std::string, std::string> tree;
+    uint64_t before = allocations.load();
+    for (size_t i = 0; i < keys.size(); i++) {
+      tree.TryEmplace(std::move(moved_keys[i]), std::move(moved_values[i]));
+    }
+    count += allocations.load() - before;
+  }
+  ReportAllocations(state, count, state.iterations() * keys.size());
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+static void BM_BigKeyGet(benchmark::State& state) {
+  std::vector<int> ids = ShuffledKeys(state.range(0));
+  AVLTree<BigKey, int> tree;
+  for (size_t i = 0; i < ids.size(); i++) {
+    tree.Add(BigKey(ids[i]), ids[i]);
+  }
+  std::vector<BigKey> keys;
+  for (size_t i = 0; i < ids.size(); i++) {
+    keys.push_back(BigKey(ids[(i * 7919) % ids.size()]));
+  }
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(tree.Get(keys[i]));
+    i = (i + 1) % keys.size();
+  }
+}
+
+static const int kSharedKeys = 1 << 20;
+
+// Even keys are loaded up front; writers churn the odd keys in between.
+static ConcurrentAVLTree<int, int>& SharedConcurrentTree() {
+  static ConcurrentAVLTree<int, int>* tree = NULL;
+  static std::once_flag once;
+  std::call_once(once, []() {
+    tree = new ConcurrentAVLTree<int, int>;
+    std::vector<int> keys = ShuffledKeys(kSharedKeys);
+    for (size_t i = 0; i < keys.size(); i++) {
+      tree->Add(keys[i] * 2, keys[i]);
+    }
+  });
+  return *tree;
+}
+
+struct LockedTree {
+  std::mutex mutex;
+  IntAVLTree tree;
+};
+
+static LockedTree& SharedLockedTree() {
+  static LockedTree* locked = NULL;
+  static std::once_flag once;
+  std::call_once(once, []() {
+    locked = new LockedTree;
+    std::vector<int> keys = ShuffledKeys(kSharedKeys);
+    for (size_t i = 0; i < keys.size(); i++) {
+      locked->tree.Add(keys[i] * 2, keys[i]);
+    }
+  });
+  return *locked;
+}
+
+// Thread 0 writes continuously; every other thread reads. Reports reads.
+static void BM_ConcurrentReadWrite(benchmark::State& state) {
+  ConcurrentAVLTree<int, int>& tree = SharedConcurrentTree();
+  std::mt19937 rng(state.thread_index());
+  bool writer = state.thread_index() == 0 && state.threads() > 1;
+  int64_t ops = 0;
+  for (auto _ : state) {
+    int key = static_cast<int>(rng() % kSharedKeys) * 2;
+    if (writer) {
+      if (ops % 2) {
+        tree.Add(key + 1, key);
+      } else {
+        tree.Remove(key + 1);
+      }
+    } else {
+      int value;
+      benchmark::DoNotOptimize(tree.Get(key, &value));
+    }
+    ops++;
+  }
+  state.SetItemsProcessed(writer ? 0 : ops);
+}
+
+// The same workload on an AVLTree behind one mutex.
+static void BM_MutexReadWrite(benchmark::State& state) {
+  LockedTree& locked = SharedLockedTree();
+  std::mt19937 rng(state.thread_index());
+  bool writer = state.thread_index() == 0 && state.threads() > 1;
+  int64_t ops = 0;
+  for (auto _ : state) {
+    int key = static_cast<int>(rng() % kSharedKeys) * 2;
+    std::lock_guard<std::mutex> lock(locked.mutex);
+    if (writer) {
+      if (ops % 2) {
+        locked.tree.Add(key + 1, key);
+      } else {
+        locked.tree.Remove(key + 1);
+      }
+    } else {
+      benchmark::DoNotOptimize(locked.tree.Get(key));
+    }
+    ops++;
+  }
+  state.SetItemsProcessed(writer ? 0 : ops);
+}
+
+static const int kShards = 64;
+
+static IntShardedAVLTree& SharedShardedTree() {
+  static IntShardedAVLTree* tree = NULL;
+  static std::once_flag once;
+  std::call_once(once, []() {
+    tree = new IntShardedAVLTree(kShards);
+    std::vector<int> keys = ShuffledKeys(kSharedKeys);
+    for (size_t i = 0; i < keys.size(); i++) {
+      tree->Add(keys[i] * 2, keys[i]);
+    }
+  });
+  return *tree;
+}
+
+// Every thread writes: adds and removes odd keys between the loaded ones.
+static void BM_ShardedWrite(benchmark::State& state) {
+  IntShardedAVLTree& tree = SharedShardedTree();
+  std::mt19937 rng(state.thread_index());
+  int64_t ops = 0;
+  for (auto _ : state) {
+    int key = static_cast<int>(rng() % kSharedKeys) * 2 + 1;
+    if (ops % 2) {
+      tree.Add(key, key);
+    } else {
+      tree.Remove(key);
+    }
+    ops++;
+  }
+  state.SetItemsProcessed(ops);
+}
+
+// The same writes on an AVLTree behind one mutex.
+static void BM_MutexWrite(benchmark::State& state) {
+  LockedTree& locked = SharedLockedTree();
+  std::mt19937 rng(state.thread_index());
+  int64_t ops = 0;
+  for (auto _ : state) {
+    int key = static_cast<int>(rng() % kSharedKeys) * 2 + 1;
+    std::lock_guard<std::mutex> lock(locked.mutex);
+    if (ops % 2) {
+      locked.tree.Add(key, key);
+    } else {
+      locked.tree.Remove(key);
+    }
+    ops++;
+  }
+  state.SetItemsProcessed(ops);
+}
+
+// AddBatch() of range(0) random items on range(1) threads.
+static void BM_ShardedAddBatch(benchmark::State& state) {
+  std::vector<int> keys = ShuffledKeys(state.range(0));
+  std::vector<std::pair<int, int> > items;
+  for (size_t i = 0; i < keys.size(); i++) {
+    items.push_back(std::make_pair(keys[i], keys[i]));
+  }
+  for (auto _ : state) {
+    IntShardedAVLTree tree(kShards);
+    tree.AddBatch(items.begin(), items.end(), state.range(1));
+    benchmark::DoNotOptimize(&tree);
+  }
+  state.SetItemsProcessed(state.iterations() * items.size());
+}
+
+}  // namespace
+
+BENCHMARK_TEMPLATE(BM_AddSequential, IntAVLTree)
+    ->RangeMultiplier(10)->Range(1000000, 100000000)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_AddSequential, RecursiveAVLTree)
+    ->RangeMultiplier(10)->Range(1000000, 100000000)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_AddRandom, IntAVLTree)
+    ->RangeMultiplier(10)->Range(1000000, 100000000)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_AddRandom, RecursiveAVLTree)
+    ->RangeMultiplier(10)->Range(1000000, 100000000)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_BuildFromSorted)->RangeMultiplier(10)->Range(1000000, 100000000)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_RemoveRandom, IntAVLTree)
+    ->RangeMultiplier(10)->Range(1000000, 100000000)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_RemoveRandom, RecursiveAVLTree)
+    ->RangeMultiplier(10)->Range(1000000, 100000000)
+    ->Unit(benchmark::kMillisecond);
+
+BENCHMARK_TEMPLATE(BM_Put, AVLStore)
+    ->ArgsProduct({benchmark::CreateRange(1000, 100000000, 100),
+                   {kSequentialOrder, kRandomOrder, kZipfOrder}})
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Put, MapStore)
+    ->ArgsProduct({benchmark::CreateRange(1000, 100000000, 100),
+                   {kSequentialOrder, kRandomOrder, kZipfOrder}})
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Get, AVLStore)
+    ->RangeMultiplier(100)->Range(1000, 100000000);
+BENCHMARK_TEMPLATE(BM_Get, MapStore)
+    ->RangeMultiplier(100)->Range(1000, 100000000);
+BENCHMARK_TEMPLATE(BM_GetLowerNearest, AVLStore)
+    ->RangeMultiplier(100)->Range(1000, 100000000);
+BENCHMARK_TEMPLATE(BM_GetLowerNearest, MapStore)
+    ->RangeMultiplier(100)->Range(1000, 100000000);
+BENCHMARK_TEMPLATE(BM_Remove, AVLStore)
+    ->RangeMultiplier(100)->Range(1000, 100000000)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Remove, MapStore)
+    ->RangeMultiplier(100)->Range(1000, 100000000)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_Ycsb, AVLStore)
+    ->ArgsProduct({benchmark::CreateRange(1000, 100000000, 100),
+                   {50, 95, 100}});
+BENCHMARK_TEMPLATE(BM_Ycsb, MapStore)
+    ->ArgsProduct({benchmark::CreateRange(1000, 100000000, 100),
+                   {50, 95, 100}});
+BENCHMARK_TEMPLATE(BM_Get, AVLStatsStore)->Arg(1000000);
+BENCHMARK_TEMPLATE(BM_Ycsb, AVLStatsStore)->Args({1000000, 50});
+
+BENCHMARK(BM_Union)
+    ->ArgsProduct({{1000000}, {10000, 1000000}, {1, 4}})
+    ->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK(BM_UnionAddLoop)->Args({1000000, 10000})->Args({1000000, 1000000})
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_AddBatch)
+    ->ArgsProduct({benchmark::CreateRange(16, 1 << 20, 16), {1, 4}})
+    ->UseRealTime();
+BENCHMARK(BM_RemoveBatch)
+    ->ArgsProduct({benchmark::CreateRange(16, 1 << 20, 16), {1, 4}})
+    ->UseRealTime();
+BENCHMARK(BM_AddLoop)->RangeMultiplier(16)->Range(16, 1 << 20);
+BENCHMARK(BM_RemoveLoop)->RangeMultiplier(16)->Range(16, 1 << 20);
+
+BENCHMARK(BM_Validate)->Arg(1)->Arg(4)->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+BENCHMARK(BM_GetRandom)->Arg(16)->Arg(256)->Arg(4096);
+BENCHMARK(BM_WindowSumScan)->RangeMultiplier(16)->Range(16, 1 << 16);
+BENCHMARK(BM_WindowSumAggregate)->RangeMultiplier(16)->Range(16, 1 << 16);
+BENCHMARK_TEMPLATE(BM_SeriesUpdate, SeriesAVLTree);
+BENCHMARK_TEMPLATE(BM_SeriesUpdate, SumAVLTree);
+BENCHMARK(BM_IntervalScan)->RangeMultiplier(32)->Range(1 << 10, 1 << 20);
+BENCHMARK(BM_IntervalOverlapping)
+    ->RangeMultiplier(32)->Range(1 << 10, 1 << 20);
+BENCHMARK(BM_IntervalCountStabbing)
+    ->RangeMultiplier(32)->Range(1 << 10, 1 << 20);
+BENCHMARK_TEMPLATE(BM_DuplicateAdd, MultiStore)->Arg(1)->Arg(8)->Arg(64)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_DuplicateAdd, VectorPerKeyStore)
+    ->Arg(1)->Arg(8)->Arg(64)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_DuplicateEqualRange, MultiStore)
+    ->Arg(1)->Arg(8)->Arg(64);
+BENCHMARK_TEMPLATE(BM_DuplicateEqualRange, VectorPerKeyStore)
+    ->Arg(1)->Arg(8)->Arg(64);
+BENCHMARK_TEMPLATE(BM_DuplicateRemoveOne, MultiStore)
+    ->Arg(1)->Arg(8)->Arg(64)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(BM_DuplicateRemoveOne, VectorPerKeyStore)
+    ->Arg(1)->Arg(8)->Arg(64)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_GetNearby)->RangeMultiplier(16)->Range(1, 1 << 16);
+BENCHMARK(BM_CursorSeekNearby)->RangeMultiplier(16)->Range(1, 1 << 16);
+BENCHMARK(BM_AppendKeys)->ArgsProduct({{1 << 16}, {0, 1}})
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_GetBatchRandom)->Arg(16)->Arg(256)->Arg(4096);
+BENCHMARK(BM_FrozenGetRandom)->Arg(16)->Arg(256)->Arg(4096);
+BENCHMARK(BM_FrozenBlockedGetRandom)
+    ->ArgsProduct({{16, 256, 4096}, {IntBlockedAVLTree::kScalar,
+                                     IntBlockedAVLTree::kSSE42,
+                                     IntBlockedAVLTree::kAVX2}});
+
+BENCHMARK(BM_StringGet)->Arg(1 << 16);
+BENCHMARK(BM_StringAdd)->Arg(1 << 16)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_StringTryEmplace)->Arg(1 << 16)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_BigKeyGet)->Arg(1 << 16);
+
+BENCHMARK(BM_RebuildWithAdd)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_SaveImage)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_LoadImage)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_MapImage)->Arg(0)->Arg(1)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_MappedGetRandom);
+
+BENCHMARK(BM_DurableAdd)->ThreadRange(1, 16)->UseRealTime();
+
+BENCHMARK(BM_ConcurrentReadWrite)->ThreadRange(1, 64)->UseRealTime();
+BENCHMARK(BM_MutexReadWrite)->ThreadRange(1, 64)->UseRealTime();
+
+BENCHMARK(BM_ShardedWrite)->ThreadRange(1, 64)->UseRealTime();
+BENCHMARK(BM_MutexWrite)->ThreadRange(1, 64)->UseRealTime();
+BENCHMARK(BM_ShardedAddBatch)->ArgsProduct({{1000000}, {1, 4, 16}})
+    ->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK_MAIN();
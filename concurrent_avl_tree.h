@@ -0,0 +1,266 @@
+/*
+ *   Copyright (c) 2011 Higepon(Taro Minowa) <higepon@users.sourceforge.jp>
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *   TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ *   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ *   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef CONCURRENT_AVL_TREE_H_
+#define CONCURRENT_AVL_TREE_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "./avl_tree.h"
+
+// AVLTree that any number of threads may read while writers modify it.
+//
+// Readers take no locks. Published nodes are never modified: a writer
+// copies the nodes on its search path, runs the ordinary AVLTree insert
+// or remove on the copies and publishes the new root with one atomic
+// store. Writers are serialized by a mutex. Replaced nodes are freed by
+// epoch-based reclamation once no reader can still be looking at them.
+template <class KeyType, class ValueType> class ConcurrentAVLTree {
+ public:
+  typedef AVLTree<KeyType, ValueType> Tree;
+  typedef typename Tree::Comparable Comparable;
+  typedef typename Tree::Node Node;
+
+  ConcurrentAVLTree() : root_(NULL), size_(0), epoch_(1) {
+    for (int i = 0; i < kReaderSlots; i++) {
+      readers_[i].epoch.store(kIdle, std::memory_order_relaxed);
+    }
+  }
+
+  // No reader or writer may be running.
+  ~ConcurrentAVLTree() {
+    if (!std::is_trivially_destructible<Node>::value) {
+      Node::DestroyTree(root_.load(std::memory_order_relaxed), pool_);
+      for (int i = 0; i < kRetiredLists; i++) {
+        FreeRetired(i);
+      }
+    }
+  }
+
+  void Add(const KeyType& key, const ValueType& value) {
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    CopyAndRetire copy(this);
+    Node* root = Node::CopyPath(root_.load(std::memory_order_relaxed), key,
+                                false, copy);
+    Node* found = Node::Insert(key, value, root, pool_);
+    if (found) {
+      found->SetValue(value);
+    } else {
+      size_.fetch_add(1, std::memory_order_relaxed);
+    }
+    Publish(root);
+  }
+
+  // Returns true if an item was removed.
+  bool Remove(const KeyType& key) {
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    Node* root = root_.load(std::memory_order_relaxed);
+    if (Node::Get(key, root, Tree::kEqCmp) == NULL) {
+      return false;
+    }
+    CopyAndRetire copy(this);
+    root = Node::CopyPath(root, key, true, copy);
+    typename Node::template CopyRotated<CopyAndRetire> copy_rotated(&copy);
+    Node* removed = Node::Remove(key, root, Tree::kEqCmp, copy_rotated);
+    // removed is a private copy that no reader has seen.
+    Node::Destroy(removed, pool_);
+    size_.fetch_sub(1, std::memory_order_relaxed);
+    Publish(root);
+    return true;
+  }
+
+  // Copies the value for key into *value and returns true, or returns
+  // false if key is absent.
+  bool Get(const KeyType& key, ValueType* value) const {
+    ReadGuard guard(this);
+    Comparable* item = Node::Get(key, guard.Root(), Tree::kEqCmp);
+    if (item == NULL) {
+      return false;
+    }
+    *value = item->Value();
+    return true;
+  }
+
+  // Copies the item with the largest key not greater than key, or returns
+  // false if there is none.
+  bool GetLowerNearest(const KeyType& key, KeyType* found_key,
+                       ValueType* value) const {
+    ReadGuard guard(this);
+    Comparable* item = Node::GetLowerNearest(key, guard.Root());
+    if (item == NULL) {
+      return false;
+    }
+    *found_key = item->Key();
+    *value = item->Value();
+    return true;
+  }
+
+  // Calls fn(const Comparable&) for every item with lo <= key <= hi, all
+  // taken from the same version of the tree. The items are only valid
+  // during the call.
+  template <class Function>
+  void ForEachInRange(const KeyType& lo, const KeyType& hi, Function fn) const {
+    ReadGuard guard(this);
+    typename Tree::Iterator end;
+    for (typename Tree::Iterator it =
+             Tree::Iterator::Bound(guard.Root(), lo, false);
+         it != end && AVLDefaultCompare()(hi, it->Key()) >= 0; ++it) {
+      fn(static_cast<const Comparable&>(*it));
+    }
+  }
+
+  size_t Size() const {
+    return size_.load(std::memory_order_relaxed);
+  }
+
+  bool IsEmpty() const {
+    return Size() == 0;
+  }
+
+ private:
+  enum {
+    kReaderSlots = 128,
+    kRetiredLists = 3
+  };
+
+  static const uint64_t kIdle = 0;
+
+  // One per concurrent reader. Holds the epoch the reader entered in, or
+  // kIdle. Padded to a cache line so readers do not share lines.
+  struct ReaderSlot {
+    std::atomic<uint64_t> epoch;
+    char padding[64 - sizeof(std::atomic<uint64_t>)];
+  };
+
+  // Pins the current epoch for as long as it lives, so nodes reachable
+  // from the root read through it stay allocated.
+  class ReadGuard {
+   public:
+    explicit ReadGuard(const ConcurrentAVLTree* tree) :
+        slot_(tree->EnterEpoch()),
+        root_(tree->root_.load(std::memory_order_seq_cst)) {
+    }
+
+    ~ReadGuard() {
+      slot_->store(kIdle, std::memory_order_release);
+    }
+
+    Node* Root() const {
+      return root_;
+    }
+
+   private:
+    std::atomic<uint64_t>* slot_;
+    Node* root_;
+
+    ReadGuard(const ReadGuard&);
+    ReadGuard& operator=(const ReadGuard&);
+  };
+
+  // Returns a private copy of a published node and schedules the
+  // original to be freed once the copy is published.
+  struct CopyAndRetire {
+    explicit CopyAndRetire(ConcurrentAVLTree* tree) : tree(tree) {}
+
+    Node* operator()(Node* n) const {
+      tree->replaced_.push_back(n);
+      return Node::Clone(n, tree->pool_);
+    }
+
+    ConcurrentAVLTree* tree;
+  };
+
+  std::atomic<uint64_t>* EnterEpoch() const {
+    size_t start = std::hash<std::thread::id>()(std::this_thread::get_id());
+    for (;;) {
+      for (int i = 0; i < kReaderSlots; i++) {
+        std::atomic<uint64_t>& slot =
+            readers_[(start + i) % kReaderSlots].epoch;
+        uint64_t idle = kIdle;
+        if (slot.load(std::memory_order_relaxed) == kIdle &&
+            slot.compare_exchange_strong(idle, epoch_.load())) {
+          return &slot;
+        }
+      }
+      std::this_thread::yield();
+    }
+  }
+
+  // Makes root visible to readers, retires the nodes it replaced and
+  // frees whatever no reader can reach any more.
+  void Publish(Node* root) {
+    root_.store(root, std::memory_order_seq_cst);
+    uint64_t epoch = epoch_.load(std::memory_order_relaxed);
+    std::vector<Node*>& retired = retired_[epoch % kRetiredLists];
+    retired.insert(retired.end(), replaced_.begin(), replaced_.end());
+    replaced_.clear();
+    TryAdvanceEpoch();
+  }
+
+  // Moves to the next epoch once every active reader has entered the
+  // current one. Nodes retired two epochs ago were unreachable before any
+  // of those readers started, so they are freed.
+  void TryAdvanceEpoch() {
+    uint64_t epoch = epoch_.load(std::memory_order_relaxed);
+    for (int i = 0; i < kReaderSlots; i++) {
+      uint64_t reader = readers_[i].epoch.load(std::memory_order_seq_cst);
+      if (reader != kIdle && reader != epoch) {
+        return;
+      }
+    }
+    epoch_.store(epoch + 1, std::memory_order_seq_cst);
+    FreeRetired((epoch + 1) % kRetiredLists);
+  }
+
+  void FreeRetired(int list) {
+    std::vector<Node*>& retired = retired_[list];
+    for (size_t i = 0; i < retired.size(); i++) {
+      Node::Destroy(retired[i], pool_);
+    }
+    retired.clear();
+  }
+
+  std::atomic<Node*> root_;
+  std::atomic<size_t> size_;
+  std::atomic<uint64_t> epoch_;
+  mutable ReaderSlot readers_[kReaderSlots];
+
+  // Owned by the writer holding write_mutex_.
+  std::mutex write_mutex_;
+  typename Tree::NodeAllocator pool_;
+  std::vector<Node*> replaced_;
+  std::vector<Node*> retired_[kRetiredLists];
+
+  ConcurrentAVLTree(const ConcurrentAVLTree&);
+  ConcurrentAVLTree& operator=(const ConcurrentAVLTree&);
+};
+
+#endif  // CONCURRENT_AVL_TREE_H_
@@ -0,0 +1,448 @@
+/*
+ *   Copyright (c) 2011 Higepon(Taro Minowa) <higepon@users.sourceforge.jp>
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *   TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ *   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ *   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef DURABLE_AVL_TREE_H_
+#define DURABLE_AVL_TREE_H_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include "./avl_tree.h"
+#include "./avl_tree_file.h"
+
+// AVLTree whose changes survive crashes.
+//
+// Every Add() and Remove() is appended to a write-ahead log in dir before
+// it returns. Writers that arrive while the log is being synced queue
+// their records, and the next sync makes all of them durable with one
+// fsync (group commit). Once the log grows past checkpoint_bytes the tree
+// is saved with SaveAVLTree() and the log starts over. Open() loads the
+// last checkpoint and replays the log, stopping at the first torn or
+// damaged record.
+//
+// All members may be called from any thread. Readers see writes as soon
+// as they are applied, which may be before they are durable.
+template <class KeyType, class ValueType> class DurableAVLTree {
+ public:
+  typedef AVLTree<KeyType, ValueType> Tree;
+  typedef typename Tree::Comparable Comparable;
+
+  struct Options {
+    Options() : sync(true), checkpoint_bytes(64 << 20) {}
+
+    // Whether Add() and Remove() wait until their record is on disk.
+    // Without it records are written in batches and made durable by
+    // Sync(), Checkpoint() or Close().
+    bool sync;
+    // Log size that triggers a checkpoint, or 0 for never.
+    size_t checkpoint_bytes;
+  };
+
+  DurableAVLTree() :
+      fd_(-1),
+      appended_(0),
+      durable_(0),
+      syncing_(false),
+      log_size_(0) {
+  }
+
+  ~DurableAVLTree() {
+    Close();
+  }
+
+  // Creates dir if needed and recovers the tree stored in it. Returns
+  // false if the files cannot be read or the checkpoint is damaged.
+  bool Open(const std::string& dir, const Options& options = Options()) {
+    Close();
+    std::unique_lock<std::mutex> lock(mutex_);
+    options_ = options;
+    dir_ = dir;
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+      return false;
+    }
+    tree_.Clear();
+    buffer_.clear();
+    appended_ = 0;
+    durable_ = 0;
+    std::string image = ImagePath();
+    if (access(image.c_str(), F_OK) == 0 &&
+        !LoadAVLTree(image.c_str(), &tree_)) {
+      return false;
+    }
+    return OpenLog();
+  }
+
+  // Makes every write so far durable and closes the files. The tree can
+  // still be read until the next Open().
+  void Close() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (fd_ < 0) {
+      return;
+    }
+    WaitDurable(&lock, appended_);
+    close(fd_);
+    fd_ = -1;
+  }
+
+  // Returns false if the store is closed or the log cannot be written;
+  // the store is closed after any write error.
+  bool Add(const KeyType& key, const ValueType& value) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (fd_ < 0) {
+      return false;
+    }
+    Append(kAddRecord, key, &value);
+    tree_.Add(key, value);
+    return Commit(&lock);
+  }
+
+  // Returns true if an item was removed and logged.
+  bool Remove(const KeyType& key) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (fd_ < 0 || tree_.Get(key) == NULL) {
+      return false;
+    }
+    Append(kRemoveRecord, key, NULL);
+    tree_.Remove(key);
+    return Commit(&lock);
+  }
+
+  // Waits until every write so far is durable.
+  bool Sync() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return fd_ >= 0 && WaitDurable(&lock, appended_);
+  }
+
+  // Saves the tree as the new checkpoint and empties the log.
+  bool Checkpoint() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return fd_ >= 0 && CheckpointLocked(&lock);
+  }
+
+  // Copies the value for key into *value and returns true, or returns
+  // false if key is absent.
+  bool Get(const KeyType& key, ValueType* value) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const Comparable* item = tree_.Get(key);
+    if (item == NULL) {
+      return false;
+    }
+    *value = item->Value();
+    return true;
+  }
+
+  size_t Size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return tree_.Size();
+  }
+
+  bool IsOpen() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return fd_ >= 0;
+  }
+
+ private:
+  enum RecordType {
+    kAddRecord = 1,
+    kRemoveRecord = 2
+  };
+
+  // Written at the start of every log.
+  struct LogHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t key_size;
+    uint32_t value_size;
+  };
+
+  // Precedes every record's payload: a type byte, the key and, for adds,
+  // the value, stored with AVLSerializer.
+  struct RecordHeader {
+    uint32_t size;
+    uint32_t reserved;
+    uint64_t checksum;
+  };
+
+  static LogHeader NewLogHeader() {
+    static const char kMagic[8] = {'A', 'V', 'L', 'W', 'A', 'L', 0, 0};
+    LogHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kMagic, sizeof(header.magic));
+    header.version = kAVLFileVersion;
+    header.byte_order = kAVLFileByteOrder;
+    header.key_size = sizeof(KeyType);
+    header.value_size = sizeof(ValueType);
+    return header;
+  }
+
+  std::string ImagePath() const {
+    return dir_ + "/checkpoint.img";
+  }
+
+  std::string LogPath() const {
+    return dir_ + "/wal.log";
+  }
+
+  void Append(RecordType type, const KeyType& key, const ValueType* value) {
+    std::string payload;
+    AVLFileWriter out(&payload);
+    uint8_t type_byte = static_cast<uint8_t>(type);
+    out.Write(&type_byte, sizeof(type_byte));
+    AVLSerializer<KeyType>::Write(&out, key);
+    if (value) {
+      AVLSerializer<ValueType>::Write(&out, *value);
+    }
+    RecordHeader header;
+    header.size = static_cast<uint32_t>(payload.size());
+    header.reserved = 0;
+    header.checksum = out.Checksum();
+    buffer_.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    buffer_.append(payload);
+    appended_++;
+  }
+
+  // Applies the records in log[offset, end) until one is torn or fails
+  // its checksum, and returns where the valid records end.
+  size_t Replay(const std::string& log, size_t offset) {
+    while (log.size() - offset >= sizeof(RecordHeader)) {
+      RecordHeader header;
+      memcpy(&header, log.data() + offset, sizeof(header));
+      if (header.size > log.size() - offset - sizeof(header)) {
+        break;
+      }
+      AVLFileReader in(log.data() + offset + sizeof(header), header.size);
+      AVLFileChecksum checksum;
+      checksum.Update(log.data() + offset + sizeof(header), header.size);
+      uint8_t type;
+      KeyType key;
+      ValueType value;
+      if (checksum.Value() != header.checksum || !in.Read(&type, 1) ||
+          !AVLSerializer<KeyType>::Read(&in, &key)) {
+        break;
+      }
+      if (type == kAddRecord && AVLSerializer<ValueType>::Read(&in, &value)) {
+        tree_.Add(key, value);
+      } else if (type == kRemoveRecord) {
+        tree_.Remove(key);
+      } else {
+        break;
+      }
+      offset += sizeof(header) + header.size;
+    }
+    return offset;
+  }
+
+  // Replays the existing log, cuts off anything after its last valid
+  // record, and opens it for appending. Starts a new log if there is
+  // none, and fails if it was written for other types.
+  bool OpenLog() {
+    std::string path = LogPath();
+    std::string log;
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file) {
+      char chunk[1 << 16];
+      size_t n;
+      while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        log.append(chunk, n);
+      }
+      fclose(file);
+    }
+    LogHeader expected = NewLogHeader();
+    if (log.size() < sizeof(expected)) {
+      // Missing, or torn while it was being created.
+      return StartLog();
+    }
+    if (memcmp(log.data(), &expected, sizeof(expected)) != 0) {
+      return false;
+    }
+    size_t end = Replay(log, sizeof(expected));
+    fd_ = open(path.c_str(), O_WRONLY);
+    if (fd_ < 0 || ftruncate(fd_, end) != 0 || fsync(fd_) != 0 ||
+        lseek(fd_, end, SEEK_SET) != static_cast<off_t>(end)) {
+      CloseAfterError();
+      return false;
+    }
+    log_size_ = end;
+    return true;
+  }
+
+  // Replaces the log with an empty one. The old log stays in place until
+  // the new one is complete.
+  bool StartLog() {
+    std::string path = LogPath();
+    std::string temp_path = path + ".tmp";
+    LogHeader header = NewLogHeader();
+    int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      return false;
+    }
+    if (!WriteAll(fd, reinterpret_cast<const char*>(&header),
+                  sizeof(header)) ||
+        fsync(fd) != 0 || rename(temp_path.c_str(), path.c_str()) != 0 ||
+        !SyncDir()) {
+      close(fd);
+      unlink(temp_path.c_str());
+      return false;
+    }
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+    fd_ = fd;
+    log_size_ = sizeof(header);
+    return true;
+  }
+
+  bool SyncDir() const {
+    int fd = open(dir_.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+  }
+
+  static bool WriteAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+      ssize_t n = write(fd, data, size);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return false;
+      }
+      data += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  // Finishes a write that holds *lock. Unsynced stores only write once
+  // the buffer is large.
+  bool Commit(std::unique_lock<std::mutex>* lock) {
+    static const size_t kUnsyncedBufferBytes = 1 << 16;
+    bool ok = true;
+    if (options_.sync) {
+      ok = WaitDurable(lock, appended_);
+    } else if (buffer_.size() >= kUnsyncedBufferBytes) {
+      ok = WaitDurable(lock, appended_);
+    }
+    if (ok && options_.checkpoint_bytes &&
+        log_size_ + buffer_.size() >= options_.checkpoint_bytes) {
+      ok = CheckpointLocked(lock);
+    }
+    return ok;
+  }
+
+  // Returns once the first record records are on disk. If no sync is
+  // running, this thread writes and syncs everything buffered so far for
+  // every waiting writer; otherwise it waits for the running one.
+  bool WaitDurable(std::unique_lock<std::mutex>* lock, uint64_t records) {
+    while (durable_ < records) {
+      if (fd_ < 0) {
+        return false;
+      }
+      if (syncing_) {
+        synced_.wait(*lock);
+        continue;
+      }
+      syncing_ = true;
+      std::string batch;
+      batch.swap(buffer_);
+      uint64_t upto = appended_;
+      int fd = fd_;
+      lock->unlock();
+      bool ok = WriteAll(fd, batch.data(), batch.size()) &&
+          fdatasync(fd) == 0;
+      lock->lock();
+      syncing_ = false;
+      if (ok) {
+        durable_ = upto;
+        log_size_ += batch.size();
+      } else {
+        CloseAfterError();
+      }
+      synced_.notify_all();
+    }
+    return true;
+  }
+
+  // The checkpoint holds every buffered write, so they need not reach
+  // the old log. Replaying a log over a checkpoint that already contains
+  // its records gives the same tree, so a crash between the two renames
+  // is harmless.
+  bool CheckpointLocked(std::unique_lock<std::mutex>* lock) {
+    while (syncing_) {
+      synced_.wait(*lock);
+    }
+    if (fd_ < 0) {
+      return false;
+    }
+    if (!SaveAVLTree(tree_, ImagePath().c_str()) || !SyncDir() ||
+        !StartLog()) {
+      CloseAfterError();
+      return false;
+    }
+    buffer_.clear();
+    durable_ = appended_;
+    synced_.notify_all();
+    return true;
+  }
+
+  void CloseAfterError() {
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+    fd_ = -1;
+  }
+
+  mutable std::mutex mutex_;
+  std::condition_variable synced_;
+  Tree tree_;
+  Options options_;
+  std::string dir_;
+  int fd_;
+  // Records not yet handed to a sync.
+  std::string buffer_;
+  uint64_t appended_;
+  uint64_t durable_;
+  bool syncing_;
+  size_t log_size_;
+
+  DurableAVLTree(const DurableAVLTree&);
+  DurableAVLTree& operator=(const DurableAVLTree&);
+};
+
+#endif  // DURABLE_AVL_TREE_H_
@@ -0,0 +1,174 @@
+/*
+ *   Copyright (c) 2011 Higepon(Taro Minowa) <higepon@users.sourceforge.jp>
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *   TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ *   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ *   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef FROZEN_AVL_TREE_H_
+#define FROZEN_AVL_TREE_H_
+
+#include <stddef.h>
+#include <vector>
+#include "./avl_tree.h"
+
+// Immutable copy of an AVLTree in one array in Eytzinger (breadth-first)
+// order. The children of position k are at 2k and 2k + 1, so there are no
+// pointers to chase, and the top levels that every search reads share a
+// few cache lines. Positions are 1-based; items_[k - 1] holds position k.
+template <class KeyType, class ValueType> class FrozenAVLTree {
+ public:
+  typedef typename AVLTree<KeyType, ValueType>::Comparable Comparable;
+
+  FrozenAVLTree() {}
+
+  // Copies every item of tree, which may be any AVLTree instantiation with
+  // the same key and value types that orders keys by operator<.
+  template <class Tree>
+  explicit FrozenAVLTree(const Tree& tree) {
+    std::vector<const typename Tree::Comparable*> sorted;
+    sorted.reserve(tree.Size());
+    for (typename Tree::iterator it = tree.begin(); it != tree.end(); ++it) {
+      sorted.push_back(&*it);
+    }
+    Build(sorted);
+  }
+
+  const Comparable* Get(const KeyType& key) const {
+    size_t k = LowerBound(key);
+    if (k && !(key < At(k).Key())) {
+      return &At(k);
+    }
+    return NULL;
+  }
+
+  // The item with the largest key not greater than key, or NULL.
+  const Comparable* GetLowerNearest(const KeyType& key) const {
+    size_t k = 1;
+    while (k <= items_.size()) {
+      Prefetch(k);
+      k = 2 * k + !(key < At(k).Key());
+    }
+    // Drop the left turns below the last right turn, and that turn.
+    k >>= TrailingZeros(k) + 1;
+    return k ? &At(k) : NULL;
+  }
+
+  // Calls fn(const Comparable&) for every item with lo <= key <= hi in key
+  // order.
+  template <class Function>
+  void ForEachInRange(const KeyType& lo, const KeyType& hi, Function fn) const {
+    for (size_t k = LowerBound(lo); k && !(hi < At(k).Key()); k = Next(k)) {
+      fn(At(k));
+    }
+  }
+
+  size_t Size() const {
+    return items_.size();
+  }
+
+  bool IsEmpty() const {
+    return items_.empty();
+  }
+
+ private:
+  const Comparable& At(size_t k) const {
+    return items_[k - 1];
+  }
+
+  // Four levels below k start at 16k, so fetch them while k is compared.
+  void Prefetch(size_t k) const {
+    if (16 * k <= items_.size()) {
+      AVL_TREE_PREFETCH(&At(16 * k));
+    }
+  }
+
+  static int TrailingZeros(size_t k) {
+#if defined(__GNUC__)
+    return k ? __builtin_ctzll(k) : 0;
+#else
+    int zeros = 0;
+    for (; k && !(k & 1); k >>= 1) {
+      zeros++;
+    }
+    return zeros;
+#endif
+  }
+
+  // Position of the first item whose key is not less than key, or 0.
+  size_t LowerBound(const KeyType& key) const {
+    size_t k = 1;
+    while (k <= items_.size()) {
+      Prefetch(k);
+      k = 2 * k + (At(k).Key() < key);
+    }
+    // Drop the right turns below the last left turn, and that turn.
+    k >>= TrailingZeros(~k) + 1;
+    return k;
+  }
+
+  // In-order successor of position k, or 0.
+  size_t Next(size_t k) const {
+    if (2 * k + 1 <= items_.size()) {
+      for (k = 2 * k + 1; 2 * k <= items_.size(); k *= 2) {
+      }
+      return k;
+    }
+    return k >> (TrailingZeros(~k) + 1);
+  }
+
+  template <class Item>
+  void Build(const std::vector<const Item*>& sorted) {
+    std::vector<size_t> rank(sorted.size() + 1);
+    size_t next = 0;
+    AssignRanks(1, &rank, &next);
+    items_.reserve(sorted.size());
+    for (size_t k = 1; k <= sorted.size(); k++) {
+      const Item* item = sorted[rank[k]];
+      items_.push_back(Comparable(item->Key(), item->Value()));
+    }
+  }
+
+  // Visits positions in order, so the i-th visited gets the i-th item.
+  static void AssignRanks(size_t k, std::vector<size_t>* rank, size_t* next) {
+    if (k >= rank->size()) {
+      return;
+    }
+    AssignRanks(2 * k, rank, next);
+    (*rank)[k] = (*next)++;
+    AssignRanks(2 * k + 1, rank, next);
+  }
+
+  std::vector<Comparable> items_;
+};
+
+// Returns an immutable, pointer-free copy of tree.
+template <class KeyType, class ValueType, template <class> class Allocator,
+          class SizePolicy, class StatsPolicy, class AggregatePolicy>
+FrozenAVLTree<KeyType, ValueType> Freeze(
+    const AVLTree<KeyType, ValueType, Allocator, SizePolicy,
+                  AVLDefaultCompare, StatsPolicy, AggregatePolicy>& tree) {
+  return FrozenAVLTree<KeyType, ValueType>(tree);
+}
+
+#endif  // FROZEN_AVL_TREE_H_
@@ -0,0 +1,314 @@
+/*
+ *   Copyright (c) 2011 Higepon(Taro Minowa) <higepon@users.sourceforge.jp>
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *   TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ *   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ *   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef FROZEN_BLOCKED_AVL_TREE_H_
+#define FROZEN_BLOCKED_AVL_TREE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits>
+#include <type_traits>
+#include <vector>
+#include "./avl_tree.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define AVL_TREE_X86_SIMD 1
+// Compiles one function for isa. flatten inlines the block search kernels
+// into it, which they must be to use the wider instructions.
+#define AVL_TREE_SIMD_FUNCTION(isa) __attribute__((target(isa), flatten))
+#else
+#define AVL_TREE_X86_SIMD 0
+#endif
+
+// Read-only copy of an AVLTree with 32 or 64-bit signed integer keys, laid
+// out as a static B-tree whose nodes are one 64-byte block of sorted keys.
+// A search compares the key against a whole block with SSE4.2 or AVX2 and
+// descends into one of kBlockKeys + 1 children, so a lookup reads about
+// log_17(n) cache lines for int keys instead of log_2(n). The instruction
+// set is picked at run time; other CPUs and compilers use a scalar loop.
+template <class KeyType, class ValueType> class FrozenBlockedAVLTree {
+ public:
+  typedef typename AVLTree<KeyType, ValueType>::Comparable Comparable;
+
+  enum Isa {
+    kScalar,
+    kSSE42,
+    kAVX2
+  };
+
+  // The widest instruction set this CPU supports.
+  static Isa DetectIsa() {
+#if AVL_TREE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      return kAVX2;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+      return kSSE42;
+    }
+#endif
+    return kScalar;
+  }
+
+  FrozenBlockedAVLTree() : isa_(DetectIsa()) {}
+
+  // Copies every item of tree, which may be any AVLTree instantiation with
+  // the same key and value types that orders keys by operator<. Searches
+  // use isa, or the widest instruction set below it that the CPU supports.
+  template <class Tree>
+  explicit FrozenBlockedAVLTree(const Tree& tree, Isa isa = kAVX2) :
+      isa_(isa < DetectIsa() ? isa : DetectIsa()) {
+    items_.reserve(tree.Size());
+    for (typename Tree::iterator it = tree.begin(); it != tree.end(); ++it) {
+      items_.push_back(Comparable(it->Key(), it->Value()));
+    }
+    blocks_.resize((items_.size() + kBlockKeys - 1) / kBlockKeys);
+    ranks_.resize(blocks_.size() * kBlockKeys);
+    size_t next = 0;
+    Fill(0, &next);
+  }
+
+  const Comparable* Get(const KeyType key) const {
+    size_t rank = Find(key, false);
+    if (rank < items_.size() && !(key < items_[rank].Key())) {
+      return &items_[rank];
+    }
+    return NULL;
+  }
+
+  // The item with the largest key not greater than key, or NULL.
+  const Comparable* GetLowerNearest(const KeyType key) const {
+    size_t rank = Find(key, true);
+    return rank ? &items_[rank - 1] : NULL;
+  }
+
+  size_t Size() const {
+    return items_.size();
+  }
+
+  bool IsEmpty() const {
+    return items_.empty();
+  }
+
+  Isa GetIsa() const {
+    return isa_;
+  }
+
+ private:
+  static_assert(std::is_integral<KeyType>::value &&
+                std::is_signed<KeyType>::value &&
+                (sizeof(KeyType) == 4 || sizeof(KeyType) == 8),
+                "FrozenBlockedAVLTree needs 32 or 64-bit signed integer keys");
+
+  typedef typename std::conditional<sizeof(KeyType) == 4, int32_t,
+                                    int64_t>::type Lane;
+
+  enum {
+    kBlockKeys = 64 / sizeof(Lane)
+  };
+
+  // Sorted keys; slots past the last item hold the largest Lane.
+  struct alignas(64) Block {
+    Lane keys[kBlockKeys];
+  };
+
+  // Each kernel returns a mask with bit i set when keys[i] < key, or
+  // keys[i] <= key if include_equal. Keys are sorted, so the bits set are
+  // a prefix and their count is the child to descend into.
+  struct ScalarKernel {
+    static unsigned Mask(const Lane* keys, Lane key, bool include_equal) {
+      unsigned mask = 0;
+      for (int i = 0; i < kBlockKeys; i++) {
+        bool below = include_equal ? !(key < keys[i]) : keys[i] < key;
+        mask |= static_cast<unsigned>(below) << i;
+      }
+      return mask;
+    }
+  };
+
+#if AVL_TREE_X86_SIMD
+  struct SSE42Kernel {
+    __attribute__((target("sse4.2")))
+    static unsigned Mask(const int32_t* keys, int32_t key,
+                         bool include_equal) {
+      __m128i k = _mm_set1_epi32(key);
+      unsigned above = 0;
+      for (int i = 0; i < 4; i++) {
+        __m128i v =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + 4 * i));
+        __m128i cmp = include_equal ? _mm_cmpgt_epi32(v, k)
+                                    : _mm_cmpgt_epi32(k, v);
+        above |= _mm_movemask_ps(_mm_castsi128_ps(cmp)) << (4 * i);
+      }
+      return include_equal ? ~above & 0xffff : above;
+    }
+
+    __attribute__((target("sse4.2")))
+    static unsigned Mask(const int64_t* keys, int64_t key,
+                         bool include_equal) {
+      __m128i k = _mm_set1_epi64x(key);
+      unsigned above = 0;
+      for (int i = 0; i < 4; i++) {
+        __m128i v =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + 2 * i));
+        __m128i cmp = include_equal ? _mm_cmpgt_epi64(v, k)
+                                    : _mm_cmpgt_epi64(k, v);
+        above |= _mm_movemask_pd(_mm_castsi128_pd(cmp)) << (2 * i);
+      }
+      return include_equal ? ~above & 0xff : above;
+    }
+  };
+
+  struct AVX2Kernel {
+    __attribute__((target("avx2")))
+    static unsigned Mask(const int32_t* keys, int32_t key,
+                         bool include_equal) {
+      __m256i k = _mm256_set1_epi32(key);
+      unsigned above = 0;
+      for (int i = 0; i < 2; i++) {
+        __m256i v = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i*>(keys + 8 * i));
+        __m256i cmp = include_equal ? _mm256_cmpgt_epi32(v, k)
+                                    : _mm256_cmpgt_epi32(k, v);
+        above |= _mm256_movemask_ps(_mm256_castsi256_ps(cmp)) << (8 * i);
+      }
+      return include_equal ? ~above & 0xffff : above;
+    }
+
+    __attribute__((target("avx2")))
+    static unsigned Mask(const int64_t* keys, int64_t key,
+                         bool include_equal) {
+      __m256i k = _mm256_set1_epi64x(key);
+      unsigned above = 0;
+      for (int i = 0; i < 2; i++) {
+        __m256i v = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i*>(keys + 4 * i));
+        __m256i cmp = include_equal ? _mm256_cmpgt_epi64(v, k)
+                                    : _mm256_cmpgt_epi64(k, v);
+        above |= _mm256_movemask_pd(_mm256_castsi256_pd(cmp)) << (4 * i);
+      }
+      return include_equal ? ~above & 0xff : above;
+    }
+  };
+
+  AVL_TREE_SIMD_FUNCTION("sse4.2")
+  size_t FindSSE42(Lane key, bool include_equal) const {
+    return Descend<SSE42Kernel>(key, include_equal);
+  }
+
+  AVL_TREE_SIMD_FUNCTION("avx2")
+  size_t FindAVX2(Lane key, bool include_equal) const {
+    return Descend<AVX2Kernel>(key, include_equal);
+  }
+#endif
+
+  // Rank of the first item whose key is greater than key, or not less
+  // than key unless include_equal. Size() if there is none.
+  size_t Find(const KeyType key, bool include_equal) const {
+    size_t rank;
+    switch (isa_) {
+#if AVL_TREE_X86_SIMD
+      case kAVX2:
+        rank = FindAVX2(key, include_equal);
+        break;
+      case kSSE42:
+        rank = FindSSE42(key, include_equal);
+        break;
+#endif
+      default:
+        rank = Descend<ScalarKernel>(key, include_equal);
+        break;
+    }
+    return rank < items_.size() ? rank : items_.size();
+  }
+
+  // Every block on the way down narrows the answer to the keys before the
+  // first one that does not match, so the last such key seen wins.
+  template <class Kernel>
+  size_t Descend(Lane key, bool include_equal) const {
+    size_t found = ranks_.size();
+    for (size_t k = 0; k < blocks_.size();) {
+      int i = Popcount(Kernel::Mask(blocks_[k].keys, key, include_equal));
+      if (i < kBlockKeys) {
+        found = k * kBlockKeys + i;
+      }
+      k = Child(k, i);
+    }
+    return found < ranks_.size() ? ranks_[found] : items_.size();
+  }
+
+  static int Popcount(unsigned mask) {
+#if defined(__GNUC__)
+    return __builtin_popcount(mask);
+#else
+    int bits = 0;
+    for (; mask; mask &= mask - 1) {
+      bits++;
+    }
+    return bits;
+#endif
+  }
+
+  static size_t Child(size_t k, int i) {
+    return k * (kBlockKeys + 1) + i + 1;
+  }
+
+  // Visits slots in key order and hands out ranks, so padding slots come
+  // after every item.
+  void Fill(size_t k, size_t* next) {
+    if (k >= blocks_.size()) {
+      return;
+    }
+    for (int i = 0; i < kBlockKeys; i++) {
+      Fill(Child(k, i), next);
+      size_t rank = (*next)++;
+      blocks_[k].keys[i] = rank < items_.size() ?
+          static_cast<Lane>(items_[rank].Key()) :
+          std::numeric_limits<Lane>::max();
+      ranks_[k * kBlockKeys + i] = rank;
+    }
+    Fill(Child(k, kBlockKeys), next);
+  }
+
+  Isa isa_;
+  std::vector<Comparable> items_;
+  std::vector<Block> blocks_;
+  std::vector<size_t> ranks_;
+};
+
+// Returns a read-only copy of tree searched with the widest instruction
+// set the CPU supports.
+template <class KeyType, class ValueType, template <class> class Allocator,
+          class SizePolicy, class StatsPolicy, class AggregatePolicy>
+FrozenBlockedAVLTree<KeyType, ValueType> FreezeBlocked(
+    const AVLTree<KeyType, ValueType, Allocator, SizePolicy,
+                  AVLDefaultCompare, StatsPolicy, AggregatePolicy>& tree) {
+  return FrozenBlockedAVLTree<KeyType, ValueType>(tree);
+}
+
+#endif  // FROZEN_BLOCKED_AVL_TREE_H_
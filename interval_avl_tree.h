@@ -0,0 +1,158 @@
+/*
+ *   Copyright (c) 2011 Higepon(Taro Minowa) <higepon@users.sourceforge.jp>
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *   TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ *   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ *   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef INTERVAL_AVL_TREE_H_
+#define INTERVAL_AVL_TREE_H_
+
+#include <stddef.h>
+#include <limits>
+#include <utility>
+#include "./avl_tree.h"
+
+// AggregatePolicy for trees keyed by closed intervals std::pair(lo, hi):
+// the largest hi in each subtree, so that searches can skip the subtrees
+// that end before the range they look for.
+template <class T> struct AVLMaxEnd {
+  static const bool kEnabled = true;
+  typedef T Type;
+
+  static T Identity() {
+    return std::numeric_limits<T>::lowest();
+  }
+
+  template <class V>
+  static T Of(const std::pair<T, T>& interval, const V&) {
+    return interval.second;
+  }
+
+  static T Combine(const T& a, const T& b) {
+    return (a < b) ? b : a;
+  }
+};
+
+// Closed intervals [lo, hi] with a value each. They are keyed by (lo, hi)
+// in an AVLTree whose nodes also keep the largest hi below them, and their
+// ends are kept in a second tree for CountStabbing(). T must be an
+// arithmetic type. Adding an interval that is already present assigns its
+// value.
+template <class T, class ValueType> class IntervalAVLTree {
+ public:
+  typedef std::pair<T, T> Interval;
+  typedef AVLTree<Interval, ValueType, AVLPoolAllocator, AVLSubtreeSize,
+                  AVLDefaultCompare, AVLNoStats, AVLMaxEnd<T> > Tree;
+  typedef typename Tree::Comparable Comparable;
+
+  IntervalAVLTree() {}
+
+  // lo must not be greater than hi.
+  void Add(const T& lo, const T& hi, const ValueType& value) {
+    if (tree_.InsertOrAssign(Interval(lo, hi), value).second) {
+      ends_.Add(Interval(hi, lo), true);
+    }
+  }
+
+  // Returns true if the interval was removed.
+  bool Remove(const T& lo, const T& hi) {
+    if (!tree_.Remove(Interval(lo, hi))) {
+      return false;
+    }
+    ends_.Remove(Interval(hi, lo));
+    return true;
+  }
+
+  Comparable* Get(const T& lo, const T& hi) const {
+    return tree_.Get(Interval(lo, hi));
+  }
+
+  // Calls fn(const Comparable&) for every interval that overlaps [lo, hi],
+  // in key order. Subtrees that end before lo are skipped, and so is
+  // everything after the first interval starting past hi, so reporting k
+  // intervals visits O((k + 1) log n) nodes.
+  template <class Function>
+  void Overlapping(const T& lo, const T& hi, Function fn) const {
+    Visit(tree_.Root(), lo, hi, fn);
+  }
+
+  // Calls fn(const Comparable&) for every interval containing point.
+  template <class Function>
+  void Overlapping(const T& point, Function fn) const {
+    Visit(tree_.Root(), point, point, fn);
+  }
+
+  // Number of intervals containing point, counted in O(log n) without
+  // visiting them: those starting at or before point, less those of them
+  // that end before it.
+  size_t CountStabbing(const T& point) const {
+    const T lowest = std::numeric_limits<T>::lowest();
+    const T max = std::numeric_limits<T>::max();
+    size_t started = tree_.CountInRange(Interval(lowest, lowest),
+                                        Interval(point, max));
+    return started - ends_.Rank(Interval(point, lowest));
+  }
+
+  size_t Size() const {
+    return tree_.Size();
+  }
+
+  bool IsEmpty() const {
+    return tree_.IsEmpty();
+  }
+
+  const Tree& Intervals() const {
+    return tree_;
+  }
+
+ private:
+  typedef typename Tree::Node Node;
+
+  // Walks the subtree at n in key order, following right children in a
+  // loop so that only left subtrees take stack.
+  template <class Function>
+  static void Visit(const Node* n, const T& lo, const T& hi,
+                    Function& fn) {  // NOLINT
+    while (n && !(n->SubtreeAggregate() < lo)) {
+      Visit(n->Left(), lo, hi, fn);
+      if (hi < n->Key().first) {
+        return;
+      }
+      if (!(n->Key().second < lo)) {
+        fn(static_cast<const Comparable&>(*n));
+      }
+      n = n->Right();
+    }
+  }
+
+  Tree tree_;
+  // (hi, lo) of every interval, for counting those that end before a
+  // point.
+  AVLTree<Interval, bool, AVLPoolAllocator, AVLSubtreeSize> ends_;
+
+  IntervalAVLTree(const IntervalAVLTree&);
+  IntervalAVLTree& operator=(const IntervalAVLTree&);
+};
+
+#endif  // INTERVAL_AVL_TREE_H_
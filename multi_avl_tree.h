@@ -0,0 +1,125 @@
+/*
+ *   Copyright (c) 2011 Higepon(Taro Minowa) <higepon@users.sourceforge.jp>
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *   TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ *   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ *   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef MULTI_AVL_TREE_H_
+#define MULTI_AVL_TREE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits>
+#include <utility>
+#include <vector>
+#include "./avl_tree.h"
+
+// AVLTree that holds any number of items per key. Every item is a node
+// of its own, keyed by (key, sequence number), so items with equal keys
+// sit next to each other in the order they were added and need no
+// allocation besides their node. Subtree sizes make Count() O(log n).
+template <class KeyType, class ValueType> class MultiAVLTree {
+ public:
+  typedef std::pair<KeyType, uint64_t> ItemKey;
+  typedef AVLTree<ItemKey, ValueType, AVLPoolAllocator, AVLSubtreeSize> Tree;
+  typedef typename Tree::Comparable Comparable;
+  typedef typename Tree::iterator iterator;
+
+  MultiAVLTree() : next_sequence_(0) {}
+
+  // Adds an item after every item with the same key.
+  void Add(const KeyType& key, const ValueType& value) {
+    tree_.TryEmplace(ItemKey(key, next_sequence_++), value);
+  }
+
+  // Number of items with key.
+  size_t Count(const KeyType& key) const {
+    return tree_.CountInRange(First(key), Last(key));
+  }
+
+  // The items with key, oldest first. Comparable::Key().first is the key.
+  std::pair<iterator, iterator> EqualRange(const KeyType& key) const {
+    return std::make_pair(tree_.lower_bound(First(key)),
+                          tree_.upper_bound(Last(key)));
+  }
+
+  // Removes the oldest item with key. Returns false if there is none.
+  bool RemoveOne(const KeyType& key) {
+    iterator it = tree_.lower_bound(First(key));
+    if (it == tree_.end() || AVLDefaultCompare()(it->Key().first, key) != 0) {
+      return false;
+    }
+    ItemKey oldest = it->Key();
+    return tree_.Remove(oldest);
+  }
+
+  // Removes every item with key in one pass and returns how many there
+  // were.
+  size_t RemoveAll(const KeyType& key) {
+    std::vector<ItemKey> keys;
+    std::pair<iterator, iterator> range = EqualRange(key);
+    for (iterator it = range.first; it != range.second; ++it) {
+      keys.push_back(it->Key());
+    }
+    tree_.RemoveBatch(keys.begin(), keys.end());
+    return keys.size();
+  }
+
+  iterator begin() const {
+    return tree_.begin();
+  }
+
+  iterator end() const {
+    return tree_.end();
+  }
+
+  size_t Size() const {
+    return tree_.Size();
+  }
+
+  bool IsEmpty() const {
+    return tree_.IsEmpty();
+  }
+
+  const Tree& Items() const {
+    return tree_;
+  }
+
+ private:
+  static ItemKey First(const KeyType& key) {
+    return ItemKey(key, 0);
+  }
+
+  static ItemKey Last(const KeyType& key) {
+    return ItemKey(key, std::numeric_limits<uint64_t>::max());
+  }
+
+  Tree tree_;
+  uint64_t next_sequence_;
+
+  MultiAVLTree(const MultiAVLTree&);
+  MultiAVLTree& operator=(const MultiAVLTree&);
+};
+
+#endif  // MULTI_AVL_TREE_H_
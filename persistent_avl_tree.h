@@ -0,0 +1,271 @@
+/*
+ *   Copyright (c) 2011 Higepon(Taro Minowa) <higepon@users.sourceforge.jp>
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *   TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ *   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ *   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef PERSISTENT_AVL_TREE_H_
+#define PERSISTENT_AVL_TREE_H_
+
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "./avl_tree.h"
+
+// SizePolicy for PersistentAVLTree nodes. Keeps no subtree sizes but
+// counts the links and snapshots that share the node.
+class AVLSharedNode : public AVLNoSubtreeSize {
+ public:
+  AVLSharedNode() : refs_(1) {}
+
+  uint32_t Refs() const {
+    return refs_;
+  }
+
+  void Ref() {
+    refs_++;
+  }
+
+  // Returns true when the last reference is gone.
+  bool Unref() {
+    return --refs_ == 0;
+  }
+
+ private:
+  uint32_t refs_;
+};
+
+// AVLTree with O(1) snapshots.
+//
+// Versions share every subtree a write did not touch. A write copies the
+// shared nodes on its path, at most O(log n) of them, and modifies nodes
+// that only the current version can reach in place. Nodes are reference
+// counted and freed when the last version that can reach them goes away.
+//
+// The tree itself is for one thread at a time. Snapshots may be read from
+// any thread without locking while the tree keeps changing.
+template <class KeyType, class ValueType> class PersistentAVLTree {
+ public:
+  typedef AVLTree<KeyType, ValueType, AVLPoolAllocator, AVLSharedNode> Tree;
+  typedef typename Tree::Comparable Comparable;
+  typedef typename Tree::Node Node;
+
+ private:
+  // Node memory shared by a tree and its snapshots. Reference counts and
+  // the pool are only touched with mutex held.
+  struct Store {
+    // Drops one reference to n and frees every node that is no longer
+    // reachable from any version.
+    void Release(Node* n) {
+      std::vector<Node*> garbage;
+      if (n && n->Unref()) {
+        garbage.push_back(n);
+      }
+      while (!garbage.empty()) {
+        Node* dead = garbage.back();
+        garbage.pop_back();
+        for (int i = Tree::kLeft; i <= Tree::kRight; i++) {
+          Node* child = dead->children[i];
+          if (child && child->Unref()) {
+            garbage.push_back(child);
+          }
+        }
+        Node::Destroy(dead, pool);
+      }
+    }
+
+    std::mutex mutex;
+    typename Tree::NodeAllocator pool;
+  };
+
+ public:
+  // Read-only view of a tree as it was when Snapshot() was called.
+  class Snapshot {
+   public:
+    Snapshot() : root_(NULL), size_(0) {}
+
+    Snapshot(const Snapshot& other) :
+        store_(other.store_),
+        root_(other.root_),
+        size_(other.size_) {
+      Ref();
+    }
+
+    Snapshot& operator=(const Snapshot& other) {
+      Snapshot copy(other);
+      std::swap(store_, copy.store_);
+      std::swap(root_, copy.root_);
+      std::swap(size_, copy.size_);
+      return *this;
+    }
+
+    ~Snapshot() {
+      if (root_) {
+        std::lock_guard<std::mutex> lock(store_->mutex);
+        store_->Release(root_);
+      }
+    }
+
+    const Comparable* Get(const KeyType& key) const {
+      return Node::Get(key, root_, Tree::kEqCmp);
+    }
+
+    const Comparable* GetLowerNearest(const KeyType& key) const {
+      return Node::GetLowerNearest(key, root_);
+    }
+
+    // Calls fn(const Comparable&) for every item with lo <= key <= hi in
+    // key order.
+    template <class Function>
+    void ForEachInRange(const KeyType& lo, const KeyType& hi,
+                        Function fn) const {
+      typename Tree::Iterator end;
+      for (typename Tree::Iterator it = Tree::Iterator::Bound(root_, lo, false);
+           it != end && AVLDefaultCompare()(hi, it->Key()) >= 0; ++it) {
+        fn(static_cast<const Comparable&>(*it));
+      }
+    }
+
+    size_t Size() const {
+      return size_;
+    }
+
+    bool IsEmpty() const {
+      return root_ == NULL;
+    }
+
+   private:
+    friend class PersistentAVLTree;
+
+    Snapshot(const std::shared_ptr<Store>& store, Node* root, size_t size) :
+        store_(store),
+        root_(root),
+        size_(size) {
+      Ref();
+    }
+
+    void Ref() {
+      if (root_) {
+        std::lock_guard<std::mutex> lock(store_->mutex);
+        root_->Ref();
+      }
+    }
+
+    std::shared_ptr<Store> store_;
+    Node* root_;
+    size_t size_;
+  };
+
+  PersistentAVLTree() : store_(new Store), root_(NULL), size_(0) {
+  }
+
+  ~PersistentAVLTree() {
+    std::lock_guard<std::mutex> lock(store_->mutex);
+    store_->Release(root_);
+  }
+
+  // Takes O(1) time and memory until the tree is next modified.
+  Snapshot GetSnapshot() const {
+    return Snapshot(store_, root_, size_);
+  }
+
+  void Add(const KeyType& key, const ValueType& value) {
+    std::lock_guard<std::mutex> lock(store_->mutex);
+    CopyShared copy(store_.get());
+    root_ = Node::CopyPath(root_, key, false, copy);
+    Node* found = Node::Insert(key, value, root_, store_->pool);
+    if (found) {
+      found->SetValue(value);
+    } else {
+      size_++;
+    }
+  }
+
+  // Returns true if an item was removed.
+  bool Remove(const KeyType& key) {
+    if (Get(key) == NULL) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(store_->mutex);
+    CopyShared copy(store_.get());
+    root_ = Node::CopyPath(root_, key, true, copy);
+    typename Node::template CopyRotated<CopyShared> copy_rotated(&copy);
+    Node* removed = Node::Remove(key, root_, Tree::kEqCmp, copy_rotated);
+    // Its links have been handed over to other nodes, so only the node
+    // itself goes.
+    Node::Destroy(removed, store_->pool);
+    size_--;
+    return true;
+  }
+
+  const Comparable* Get(const KeyType& key) const {
+    return Node::Get(key, root_, Tree::kEqCmp);
+  }
+
+  const Comparable* GetLowerNearest(const KeyType& key) const {
+    return Node::GetLowerNearest(key, root_);
+  }
+
+  size_t Size() const {
+    return size_;
+  }
+
+  bool IsEmpty() const {
+    return root_ == NULL;
+  }
+
+ private:
+  // Copies n if another version can reach it and returns the node to
+  // modify. The copy takes over the link that pointed at n, and it adds
+  // a link to each of n's children.
+  struct CopyShared {
+    explicit CopyShared(Store* store) : store(store) {}
+
+    Node* operator()(Node* n) const {
+      if (n->Refs() == 1) {
+        return n;
+      }
+      Node* copy = Node::Clone(n, store->pool);
+      for (int i = Tree::kLeft; i <= Tree::kRight; i++) {
+        if (copy->children[i]) {
+          copy->children[i]->Ref();
+        }
+      }
+      n->Unref();
+      return copy;
+    }
+
+    Store* store;
+  };
+
+  std::shared_ptr<Store> store_;
+  Node* root_;
+  size_t size_;
+
+  PersistentAVLTree(const PersistentAVLTree&);
+  PersistentAVLTree& operator=(const PersistentAVLTree&);
+};
+
+#endif  // PERSISTENT_AVL_TREE_H_
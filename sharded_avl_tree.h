@@ -0,0 +1,267 @@
+/*
+ *   Copyright (c) 2011 Higepon(Taro Minowa) <higepon@users.sourceforge.jp>
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following conditions
+ *   are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ *   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *   TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ *   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ *   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef SHARDED_AVL_TREE_H_
+#define SHARDED_AVL_TREE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "./avl_tree.h"
+
+// Partitioner for ShardedAVLTree that spreads keys over the shards by
+// hash. Any key pattern spreads evenly, but ordered walks have to merge
+// every shard.
+template <class KeyType> struct AVLHashPartitioner {
+  // Keys in shard i are not ordered against keys in shard i + 1.
+  static const bool kOrdered = false;
+
+  size_t operator()(const KeyType& key, size_t shards) const {
+    // std::hash is the identity for integers, so mix the bits first.
+    uint64_t h = std::hash<KeyType>()(key) * 0x9e3779b97f4a7c15ULL;
+    return static_cast<size_t>((h >> 32) % shards);
+  }
+};
+
+// Partitioner for ShardedAVLTree that gives each shard a range of keys.
+// Shard i holds the keys k with bounds[i - 1] <= k < bounds[i], so
+// ordered walks visit one shard after another, but a skewed key set
+// loads some shards more than others.
+template <class KeyType> class AVLRangePartitioner {
+ public:
+  static const bool kOrdered = true;
+
+  // bounds must be sorted; there should be one fewer than shards.
+  explicit AVLRangePartitioner(const std::vector<KeyType>& bounds) :
+      bounds_(bounds) {
+  }
+
+  size_t operator()(const KeyType& key, size_t shards) const {
+    size_t i = std::upper_bound(bounds_.begin(), bounds_.end(), key) -
+        bounds_.begin();
+    return (i < shards) ? i : shards - 1;
+  }
+
+ private:
+  std::vector<KeyType> bounds_;
+};
+
+// Front end over several independent AVLTrees, each behind its own lock,
+// so that writers to different shards do not wait for each other. Every
+// key lives in the shard Partitioner picks for it. Ordered walks lock
+// every shard and merge them.
+template <class KeyType, class ValueType,
+          class Partitioner = AVLHashPartitioner<KeyType> >
+class ShardedAVLTree {
+ public:
+  typedef AVLTree<KeyType, ValueType> Tree;
+  typedef typename Tree::Comparable Comparable;
+
+  explicit ShardedAVLTree(size_t shards,
+                          const Partitioner& partitioner = Partitioner()) :
+      shards_(shards ? shards : 1),
+      partitioner_(partitioner) {
+  }
+
+  void Add(const KeyType& key, const ValueType& value) {
+    Shard& shard = ShardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.tree.Add(key, value);
+  }
+
+  // Returns true if an item was removed.
+  bool Remove(const KeyType& key) {
+    Shard& shard = ShardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    return shard.tree.Remove(key);
+  }
+
+  // Copies the value for key into *value and returns true, or returns
+  // false if key is absent.
+  bool Get(const KeyType& key, ValueType* value) const {
+    const Shard& shard = ShardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    Comparable* item = shard.tree.Get(key);
+    if (item == NULL) {
+      return false;
+    }
+    *value = item->Value();
+    return true;
+  }
+
+  // Adds the std::pair-like items in [first, last) as if by Add() in
+  // order. Up to threads threads first sort the items by shard, and then
+  // each adds to its own shards, taking each lock once instead of once
+  // per item.
+  template <class RandomIt>
+  void AddBatch(RandomIt first, RandomIt last, size_t threads) {
+    size_t n = last - first;
+    threads = std::max<size_t>(1, std::min(threads, shards_.size()));
+    // routes[t][s] lists the items of thread t's slice that go to shard s.
+    std::vector<std::vector<std::vector<size_t> > > routes(threads);
+    RunThreads(threads, [&](size_t t) {
+      routes[t].resize(shards_.size());
+      for (size_t i = n * t / threads; i < n * (t + 1) / threads; i++) {
+        routes[t][partitioner_(first[i].first, shards_.size())].push_back(i);
+      }
+    });
+    RunThreads(threads, [&](size_t t) {
+      for (size_t s = t; s < shards_.size(); s += threads) {
+        std::lock_guard<std::mutex> lock(shards_[s].mutex);
+        for (size_t from = 0; from < threads; from++) {
+          const std::vector<size_t>& route = routes[from][s];
+          for (size_t i = 0; i < route.size(); i++) {
+            shards_[s].tree.Add(first[route[i]].first,
+                                first[route[i]].second);
+          }
+        }
+      }
+    });
+  }
+
+  // Calls fn(const Comparable&) for every item in key order. Holds every
+  // shard lock during the walk, so the items form one consistent state.
+  template <class Function>
+  void ForEach(Function fn) const {
+    Walk(NULL, NULL, fn);
+  }
+
+  // As ForEach(), but only for the items with lo <= key <= hi.
+  template <class Function>
+  void ForEachInRange(const KeyType& lo, const KeyType& hi,
+                      Function fn) const {
+    Walk(&lo, &hi, fn);
+  }
+
+  size_t Size() const {
+    size_t size = 0;
+    for (size_t i = 0; i < shards_.size(); i++) {
+      std::lock_guard<std::mutex> lock(shards_[i].mutex);
+      size += shards_[i].tree.Size();
+    }
+    return size;
+  }
+
+  bool IsEmpty() const {
+    return Size() == 0;
+  }
+
+  size_t ShardCount() const {
+    return shards_.size();
+  }
+
+ private:
+  typedef typename Tree::iterator Iterator;
+
+  // Padded to whole cache lines so neighbouring locks are not shared.
+  struct alignas(64) Shard {
+    mutable std::mutex mutex;
+    Tree tree;
+  };
+
+  Shard& ShardFor(const KeyType& key) {
+    return shards_[partitioner_(key, shards_.size())];
+  }
+
+  const Shard& ShardFor(const KeyType& key) const {
+    return shards_[partitioner_(key, shards_.size())];
+  }
+
+  // Calls fn(t) for every t < threads, on a new thread for all but t = 0.
+  template <class Function>
+  static void RunThreads(size_t threads, Function fn) {
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < threads; t++) {
+      workers.push_back(std::thread(fn, t));
+    }
+    fn(0);
+    for (size_t t = 0; t < workers.size(); t++) {
+      workers[t].join();
+    }
+  }
+
+  // Visits the items between *lo and *hi, or from either end where they
+  // are NULL; a range with *hi < *lo is empty. Locks are taken in shard
+  // order, so walks do not deadlock.
+  template <class Function>
+  void Walk(const KeyType* lo, const KeyType* hi, Function fn) const {
+    if (lo && hi && AVLDefaultCompare()(*hi, *lo) < 0) {
+      return;
+    }
+    std::vector<std::unique_lock<std::mutex> > locks;
+    std::vector<Iterator> its;
+    std::vector<Iterator> ends;
+    for (size_t i = 0; i < shards_.size(); i++) {
+      locks.push_back(std::unique_lock<std::mutex>(shards_[i].mutex));
+      const Tree& tree = shards_[i].tree;
+      its.push_back(lo ? tree.lower_bound(*lo) : tree.begin());
+      ends.push_back(hi ? tree.upper_bound(*hi) : tree.end());
+    }
+    if (Partitioner::kOrdered) {
+      for (size_t i = 0; i < its.size(); i++) {
+        for (; its[i] != ends[i]; ++its[i]) {
+          fn(static_cast<const Comparable&>(*its[i]));
+        }
+      }
+      return;
+    }
+    // k-way merge on a min-heap of the shards that have items left.
+    std::vector<size_t> heap;
+    for (size_t i = 0; i < its.size(); i++) {
+      if (its[i] != ends[i]) {
+        heap.push_back(i);
+      }
+    }
+    auto later = [&its](size_t a, size_t b) {
+      return AVLDefaultCompare()(its[b]->Key(), its[a]->Key()) < 0;
+    };
+    std::make_heap(heap.begin(), heap.end(), later);
+    while (!heap.empty()) {
+      std::pop_heap(heap.begin(), heap.end(), later);
+      size_t i = heap.back();
+      fn(static_cast<const Comparable&>(*its[i]));
+      if (++its[i] != ends[i]) {
+        std::push_heap(heap.begin(), heap.end(), later);
+      } else {
+        heap.pop_back();
+      }
+    }
+  }
+
+  std::vector<Shard> shards_;
+  Partitioner partitioner_;
+
+  ShardedAVLTree(const ShardedAVLTree&);
+  ShardedAVLTree& operator=(const ShardedAVLTree&);
+};
+
+#endif  // SHARDED_AVL_TREE_H_
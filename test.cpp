@@ -25,11 +25,31 @@
  *   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  *
  */
+#include <signal.h>
 #include <stdint.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include <gtest/gtest.h>
 #include <algorithm>
+#include <limits>
+#include <map>
+#include <memory>
+#include <random>
+#include <set>
 #include <string>
+#include <string_view>
+#include <vector>
+#include <thread>
 #include "./avl_tree.h"
+#include "./avl_tree_file.h"
+#include "./concurrent_avl_tree.h"
+#include "./durable_avl_tree.h"
+#include "./frozen_avl_tree.h"
+#include "./interval_avl_tree.h"
+#include "./multi_avl_tree.h"
+#include "./frozen_blocked_avl_tree.h"
+#include "./persistent_avl_tree.h"
+#include "./sharded_avl_tree.h"
 
 namespace {
 
@@ -38,10 +58,23 @@ typedef IntAVLTree::Node Node;
 
 static void ExpectNodeEq(int expected_key, int8_t expected_factor, Node* node) {
   ASSERT_TRUE(node != NULL);
-  EXPECT_EQ(expected_key, node->item->Key());
+  EXPECT_EQ(expected_key, node->Key());
   EXPECT_EQ(expected_factor, node->balance_factor);
 }
 
+// Returns the height of the subtree and checks every balance factor in it.
+template <class NodeType>
+static int CheckedHeight(NodeType* node) {
+  if (node == NULL) {
+    return 0;
+  }
+  int l = CheckedHeight(node->Left());
+  int r = CheckedHeight(node->Right());
+  EXPECT_EQ(r - l, node->balance_factor) << "key " << node->Key();
+  EXPECT_LE(abs(r - l), 1);
+  return std::max(l, r) + 1;
+}
+
 #define EXPECT_NODE_EQ(key, factor, node) { \
   SCOPED_TRACE(""); \
   ExpectNodeEq(key, factor, node);   \
@@ -183,31 +216,31 @@ TEST_F(AVLTreeTest, RightRotation) {
 
   tree_.Add(2, 2);
   EXPECT_EQ(IntAVLTree::kL, tree_.Root()->balance_factor);
-  EXPECT_EQ(5, tree_.Root()->Left()->item->Key());
+  EXPECT_EQ(5, tree_.Root()->Left()->Key());
   EXPECT_EQ(IntAVLTree::kL, tree_.Root()->Left()->balance_factor);
-  EXPECT_EQ(3, tree_.Root()->Left()->Left()->item->Key());
+  EXPECT_EQ(3, tree_.Root()->Left()->Left()->Key());
   EXPECT_EQ(IntAVLTree::kL, tree_.Root()->Left()->Left()->balance_factor);
-  EXPECT_EQ(2, tree_.Root()->Left()->Left()->Left()->item->Key());
+  EXPECT_EQ(2, tree_.Root()->Left()->Left()->Left()->Key());
   EXPECT_EQ(IntAVLTree::kE,
             tree_.Root()->Left()->Left()->Left()->balance_factor);
 
   tree_.Add(1, 1);
-  EXPECT_EQ(7, tree_.Root()->item->Key());
+  EXPECT_EQ(7, tree_.Root()->Key());
   EXPECT_EQ(IntAVLTree::kL, tree_.Root()->balance_factor);
 
   EXPECT_EQ(IntAVLTree::kL, tree_.Root()->Left()->balance_factor);
-  EXPECT_EQ(5, tree_.Root()->Left()->item->Key());
+  EXPECT_EQ(5, tree_.Root()->Left()->Key());
 
   EXPECT_EQ(IntAVLTree::kE, tree_.Root()->Left()->Left()->balance_factor);
-  EXPECT_EQ(2, tree_.Root()->Left()->Left()->item->Key());
+  EXPECT_EQ(2, tree_.Root()->Left()->Left()->Key());
 
   EXPECT_EQ(IntAVLTree::kE,
             tree_.Root()->Left()->Left()->Left()->balance_factor);
-  EXPECT_EQ(1, tree_.Root()->Left()->Left()->Left()->item->Key());
+  EXPECT_EQ(1, tree_.Root()->Left()->Left()->Left()->Key());
 
   EXPECT_EQ(IntAVLTree::kE,
             tree_.Root()->Left()->Left()->Right()->balance_factor);
-  EXPECT_EQ(3, tree_.Root()->Left()->Left()->Right()->item->Key());
+  EXPECT_EQ(3, tree_.Root()->Left()->Left()->Right()->Key());
 }
 
 TEST_F(AVLTreeTest, InsertMany) {
@@ -308,6 +341,1878 @@ TEST_F(AVLTreeTest, RemoveMany) {
   tree_.Remove(727);
 }
 
+TEST_F(AVLTreeTest, RandomAddRemoveMatchesMap) {
+  std::map<int, int> expected;
+  srand(1);
+  for (int i = 0; i < 20000; i++) {
+    int key = rand() % 2000; // NOLINT
+    if (rand() % 3) { // NOLINT
+      tree_.Add(key, i);
+      expected[key] = i;
+    } else {
+      EXPECT_EQ(expected.erase(key) == 1, tree_.Remove(key));
+    }
+    if (i % 1000 == 0) {
+      CheckedHeight(tree_.Root());
+    }
+  }
+  CheckedHeight(tree_.Root());
+  for (int key = 0; key < 2000; key++) {
+    std::map<int, int>::const_iterator it = expected.find(key);
+    if (it == expected.end()) {
+      EXPECT_TRUE(tree_.Get(key) == NULL);
+    } else {
+      EXPECT_EQ(it->second, tree_.Get(key)->Value());
+    }
+  }
+}
+
+TEST_F(AVLTreeTest, IterateEmpty) {
+  EXPECT_TRUE(tree_.begin() == tree_.end());
+  EXPECT_TRUE(tree_.lower_bound(1) == tree_.end());
+}
+
+TEST_F(AVLTreeTest, IterateInOrder) {
+  std::map<int, int> expected;
+  srand(2);
+  for (int i = 0; i < 3000; i++) {
+    int key = rand() % 5000; // NOLINT
+    tree_.Add(key, i);
+    expected[key] = i;
+  }
+  std::map<int, int>::const_iterator e = expected.begin();
+  for (IntAVLTree::iterator it = tree_.begin(); it != tree_.end(); ++it, ++e) {
+    ASSERT_TRUE(e != expected.end());
+    EXPECT_EQ(e->first, it->Key());
+    EXPECT_EQ(e->second, (*it).Value());
+  }
+  EXPECT_TRUE(e == expected.end());
+
+  std::map<int, int>::const_reverse_iterator r = expected.rbegin();
+  IntAVLTree::iterator it = tree_.end();
+  while (it != tree_.begin()) {
+    --it;
+    EXPECT_EQ(r->first, it->Key());
+    ++r;
+  }
+  EXPECT_TRUE(r == expected.rend());
+}
+
+TEST_F(AVLTreeTest, RangeForLoop) {
+  for (int i = 10; i > 0; i--) {
+    tree_.Add(i, i * 2);
+  }
+  int next = 1;
+  for (IntAVLTree::Comparable& item : tree_) {
+    EXPECT_EQ(next, item.Key());
+    EXPECT_EQ(next * 2, item.Value());
+    next++;
+  }
+  EXPECT_EQ(11, next);
+  EXPECT_EQ(10, std::distance(tree_.begin(), tree_.end()));
+}
+
+TEST_F(AVLTreeTest, Bounds) {
+  for (int i = 0; i < 100; i += 10) {
+    tree_.Add(i, i);
+  }
+  EXPECT_EQ(20, tree_.lower_bound(20)->Key());
+  EXPECT_EQ(30, tree_.upper_bound(20)->Key());
+  EXPECT_EQ(30, tree_.lower_bound(21)->Key());
+  EXPECT_EQ(0, tree_.lower_bound(-5)->Key());
+  EXPECT_TRUE(tree_.lower_bound(91) == tree_.end());
+  EXPECT_TRUE(tree_.upper_bound(90) == tree_.end());
+  EXPECT_EQ(80, (--tree_.upper_bound(85))->Key());
+
+  std::pair<IntAVLTree::iterator, IntAVLTree::iterator> range =
+      tree_.equal_range(40);
+  EXPECT_EQ(40, range.first->Key());
+  EXPECT_EQ(50, range.second->Key());
+  range = tree_.equal_range(45);
+  EXPECT_TRUE(range.first == range.second);
+}
+
+TEST_F(AVLTreeTest, ForEachInRange) {
+  for (int i = 0; i < 1000; i++) {
+    tree_.Add(i * 2, i);
+  }
+  std::vector<int> keys;
+  tree_.ForEachInRange(101, 120, [&keys](IntAVLTree::Comparable& item) {
+    keys.push_back(item.Key());
+  });
+  ASSERT_EQ(10U, keys.size());
+  EXPECT_EQ(102, keys.front());
+  EXPECT_EQ(120, keys.back());
+
+  keys.clear();
+  tree_.ForEachInRange(5000, 6000, [&keys](IntAVLTree::Comparable& item) {
+    keys.push_back(item.Key());
+  });
+  EXPECT_TRUE(keys.empty());
+}
+
+TEST_F(AVLTreeTest, GetBatch) {
+  for (int i = 0; i < 1000; i += 2) {
+    tree_.Add(i, i * 10);
+  }
+  std::vector<int> keys;
+  for (int i = -5; i < 1005; i += 3) {
+    keys.push_back(i);
+  }
+  std::vector<IntAVLTree::Comparable*> out(keys.size());
+  tree_.GetBatch(&keys[0], keys.size(), &out[0]);
+  for (size_t i = 0; i < keys.size(); i++) {
+    EXPECT_EQ(tree_.Get(keys[i]), out[i]) << "key " << keys[i];
+  }
+
+  IntAVLTree empty;
+  IntAVLTree::Comparable* none = tree_.Root();
+  empty.GetBatch(&keys[0], 1, &none);
+  EXPECT_TRUE(none == NULL);
+}
+
+TEST_F(AVLTreeTest, RemoveKeepsOtherItemsInPlace) {
+  MakePreDoubleLeftRotationTree();
+  IntAVLTree::Comparable* seven = tree_.Get(7);
+  IntAVLTree::Comparable* three = tree_.Get(3);
+  EXPECT_TRUE(tree_.Remove(5));
+  EXPECT_TRUE(tree_.IsBalanced());
+  EXPECT_TRUE(tree_.Get(5) == NULL);
+  EXPECT_EQ(seven, tree_.Get(7));
+  EXPECT_EQ(three, tree_.Get(3));
+  EXPECT_EQ(7, seven->Value());
+  EXPECT_EQ(seven, tree_.Root()->Left());
+  EXPECT_NODE_EQ(7, IntAVLTree::kL, tree_.Root()->Left());
+}
+
+typedef AVLTree<int, int, AVLPoolAllocator, AVLSubtreeSize> RankedAVLTree;
+
+static size_t CheckedSize(RankedAVLTree::Node* node) {
+  if (node == NULL) {
+    return 0;
+  }
+  size_t size = 1 + CheckedSize(node->Left()) + CheckedSize(node->Right());
+  EXPECT_EQ(size, node->SubtreeSize()) << "key " << node->Key();
+  return size;
+}
+
+TEST(AVLTreeOrderStatisticTest, Size) {
+  IntAVLTree tree;
+  EXPECT_EQ(0U, tree.Size());
+  tree.Add(1, 1);
+  tree.Add(2, 2);
+  tree.Add(1, 3);
+  EXPECT_EQ(2U, tree.Size());
+  tree.Remove(5);
+  tree.Remove(1);
+  EXPECT_EQ(1U, tree.Size());
+  tree.Clear();
+  EXPECT_EQ(0U, tree.Size());
+}
+
+TEST(AVLTreeOrderStatisticTest, RankAndSelectMatchSortedKeys) {
+  RankedAVLTree tree;
+  std::map<int, int> expected;
+  srand(3);
+  for (int i = 0; i < 10000; i++) {
+    int key = rand() % 3000; // NOLINT
+    if (rand() % 4) { // NOLINT
+      tree.Add(key, i);
+      expected[key] = i;
+    } else {
+      tree.Remove(key);
+      expected.erase(key);
+    }
+  }
+  CheckedSize(tree.Root());
+  ASSERT_EQ(expected.size(), tree.Size());
+  EXPECT_EQ(expected.size(), tree.Root()->SubtreeSize());
+
+  size_t rank = 0;
+  for (std::map<int, int>::const_iterator it = expected.begin();
+       it != expected.end(); ++it, ++rank) {
+    EXPECT_EQ(rank, tree.Rank(it->first));
+    ASSERT_TRUE(tree.Select(rank) != NULL);
+    EXPECT_EQ(it->first, tree.Select(rank)->Key());
+  }
+  EXPECT_TRUE(tree.Select(expected.size()) == NULL);
+  EXPECT_EQ(0U, tree.Rank(-1));
+  EXPECT_EQ(expected.size(), tree.Rank(3000));
+}
+
+TEST(AVLTreeOrderStatisticTest, CountInRange) {
+  RankedAVLTree tree;
+  for (int i = 0; i < 100; i++) {
+    tree.Add(i * 10, i);
+  }
+  EXPECT_EQ(3U, tree.CountInRange(100, 120));
+  EXPECT_EQ(2U, tree.CountInRange(101, 120));
+  EXPECT_EQ(1U, tree.CountInRange(990, 5000));
+  EXPECT_EQ(100U, tree.CountInRange(-5, 990));
+  EXPECT_EQ(0U, tree.CountInRange(1, 9));
+  EXPECT_EQ(0U, tree.CountInRange(120, 100));
+}
+
+TEST(AVLTreeBuildTest, BuildFromSorted) {
+  for (int n = 0; n < 70; n++) {
+    std::vector<std::pair<int, int> > items;
+    for (int i = 0; i < n; i++) {
+      items.push_back(std::make_pair(i * 3, i));
+    }
+    RankedAVLTree tree(items.begin(), items.end());
+    EXPECT_EQ(static_cast<size_t>(n), tree.Size());
+    CheckedHeight(tree.Root());
+    CheckedSize(tree.Root());
+    int i = 0;
+    for (RankedAVLTree::iterator it = tree.begin(); it != tree.end();
+         ++it, ++i) {
+      EXPECT_EQ(i * 3, it->Key());
+      EXPECT_EQ(i, it->Value());
+    }
+    EXPECT_EQ(n, i);
+  }
+}
+
+TEST(AVLTreeBuildTest, BuiltTreeAcceptsUpdates) {
+  std::vector<std::pair<int, int> > items;
+  for (int i = 0; i < 1000; i++) {
+    items.push_back(std::make_pair(i, i));
+  }
+  IntAVLTree tree;
+  tree.Add(5000, 5000);
+  tree.BuildFromSorted(items.begin(), items.end());
+  EXPECT_TRUE(tree.Get(5000) == NULL);
+  for (int i = 0; i < 1000; i += 3) {
+    EXPECT_TRUE(tree.Remove(i));
+  }
+  for (int i = 1000; i < 1500; i++) {
+    tree.Add(i, i);
+  }
+  CheckedHeight(tree.Root());
+  EXPECT_EQ(1166U, tree.Size());
+  EXPECT_EQ(1499, tree.Get(1499)->Value());
+}
+
+TEST(AVLTreeBuildTest, BuildFromSortedParallel) {
+  std::vector<std::pair<int, int> > items;
+  for (int i = 0; i < 5000; i++) {
+    items.push_back(std::make_pair(i, -i));
+  }
+  RankedAVLTree tree;
+  tree.BuildFromSortedParallel(items.begin(), items.end(), 8);
+  CheckedSize(tree.Root());
+  EXPECT_EQ(5000U, tree.Size());
+  EXPECT_EQ(-4321, tree.Get(4321)->Value());
+  EXPECT_EQ(2500, tree.Select(2500)->Key());
+
+  AVLTree<int, int, AVLHeapAllocator> heap_tree;
+  heap_tree.BuildFromSortedParallel(items.begin(), items.end(), 8);
+  EXPECT_EQ(-17, heap_tree.Get(17)->Value());
+  EXPECT_TRUE(heap_tree.IsBalanced());
+}
+
+typedef ConcurrentAVLTree<int, int> IntConcurrentAVLTree;
+
+TEST(ConcurrentAVLTreeTest, MatchesMap) {
+  IntConcurrentAVLTree tree;
+  std::map<int, int> expected;
+  srand(4);
+  for (int i = 0; i < 5000; i++) {
+    int key = rand() % 1000; // NOLINT
+    if (rand() % 3) { // NOLINT
+      tree.Add(key, i);
+      expected[key] = i;
+    } else {
+      EXPECT_EQ(expected.erase(key) == 1, tree.Remove(key));
+    }
+  }
+  EXPECT_EQ(expected.size(), tree.Size());
+  for (int key = 0; key < 1000; key++) {
+    int value = -1;
+    std::map<int, int>::const_iterator it = expected.find(key);
+    EXPECT_EQ(it != expected.end(), tree.Get(key, &value));
+    if (it != expected.end()) {
+      EXPECT_EQ(it->second, value);
+    }
+  }
+  int found_key;
+  int value;
+  ASSERT_TRUE(tree.GetLowerNearest(1500, &found_key, &value));
+  EXPECT_EQ(expected.rbegin()->first, found_key);
+  EXPECT_FALSE(tree.GetLowerNearest(-1, &found_key, &value));
+
+  std::vector<int> keys;
+  tree.ForEachInRange(100, 200,
+                      [&keys](const IntConcurrentAVLTree::Comparable& item) {
+    keys.push_back(item.Key());
+  });
+  std::vector<int> expected_keys;
+  for (std::map<int, int>::const_iterator it = expected.lower_bound(100);
+       it != expected.end() && it->first <= 200; ++it) {
+    expected_keys.push_back(it->first);
+  }
+  EXPECT_EQ(expected_keys, keys);
+}
+
+// Key ordered only through compare(), as std::string is, with no
+// operator<, so any code that bypasses AVLDefaultCompare fails to build.
+struct CompareOnlyKey {
+  explicit CompareOnlyKey(int n) : n(n) {}
+
+  int compare(const CompareOnlyKey& other) const {
+    return (n > other.n) - (n < other.n);
+  }
+
+  int n;
+};
+
+TEST(ConcurrentAVLTreeTest, RangeUsesTreeOrder) {
+  ConcurrentAVLTree<CompareOnlyKey, int> tree;
+  for (int i = 0; i < 100; i++) {
+    tree.Add(CompareOnlyKey(i), i);
+  }
+  std::vector<int> keys;
+  tree.ForEachInRange(CompareOnlyKey(10), CompareOnlyKey(20),
+      [&keys](const ConcurrentAVLTree<CompareOnlyKey, int>::Comparable& item) {
+    keys.push_back(item.Key().n);
+  });
+  ASSERT_EQ(11U, keys.size());
+  EXPECT_EQ(10, keys.front());
+  EXPECT_EQ(20, keys.back());
+}
+
+// Readers look up keys that are always present while a writer churns
+// the keys in between and rotations move nodes around them.
+TEST(ConcurrentAVLTreeTest, ReadersSeeStableKeysDuringWrites) {
+  IntConcurrentAVLTree tree;
+  const int kKeys = 2000;
+  for (int i = 0; i < kKeys; i += 2) {
+    tree.Add(i, i);
+  }
+  std::atomic<bool> done(false);
+  std::atomic<int> failures(0);
+  std::vector<std::thread> readers;
+  for (int r = 0; r < 4; r++) {
+    readers.push_back(std::thread([&tree, &done, &failures, r]() {
+      unsigned seed = r;
+      while (!done.load()) {
+        int key = (rand_r(&seed) % (kKeys / 2)) * 2;
+        int value = -1;
+        if (!tree.Get(key, &value) || value != key) {
+          failures++;
+        }
+        int previous = -1;
+        tree.ForEachInRange(key, key + 20,
+            [&previous, &failures](
+                const IntConcurrentAVLTree::Comparable& item) {
+          if (item.Key() <= previous) {
+            failures++;
+          }
+          previous = item.Key();
+        });
+      }
+    }));
+  }
+  unsigned seed = 99;
+  for (int i = 0; i < 20000; i++) {
+    int key = (rand_r(&seed) % (kKeys / 2)) * 2 + 1;
+    if (i % 2) {
+      tree.Add(key, key);
+    } else {
+      tree.Remove(key);
+    }
+  }
+  done = true;
+  for (size_t i = 0; i < readers.size(); i++) {
+    readers[i].join();
+  }
+  EXPECT_EQ(0, failures.load());
+  for (int i = 0; i < kKeys; i += 2) {
+    int value;
+    EXPECT_TRUE(tree.Get(i, &value));
+  }
+}
+
+typedef PersistentAVLTree<int, int> IntPersistentAVLTree;
+
+static std::map<int, int> SnapshotContents(
+    const IntPersistentAVLTree::Snapshot& snapshot) {
+  std::map<int, int> contents;
+  snapshot.ForEachInRange(INT32_MIN, INT32_MAX,
+      [&contents](const IntPersistentAVLTree::Comparable& item) {
+    contents[item.Key()] = item.Value();
+  });
+  return contents;
+}
+
+TEST(PersistentAVLTreeTest, SnapshotsKeepTheirVersion) {
+  IntPersistentAVLTree tree;
+  std::map<int, int> expected;
+  std::vector<IntPersistentAVLTree::Snapshot> snapshots;
+  std::vector<std::map<int, int> > versions;
+  srand(5);
+  for (int i = 0; i < 4000; i++) {
+    int key = rand() % 500; // NOLINT
+    if (rand() % 3) { // NOLINT
+      tree.Add(key, i);
+      expected[key] = i;
+    } else {
+      EXPECT_EQ(expected.erase(key) == 1, tree.Remove(key));
+    }
+    if (i % 500 == 0) {
+      snapshots.push_back(tree.GetSnapshot());
+      versions.push_back(expected);
+    }
+  }
+  EXPECT_EQ(expected.size(), tree.Size());
+  for (size_t i = 0; i < snapshots.size(); i++) {
+    EXPECT_EQ(versions[i], SnapshotContents(snapshots[i]));
+    EXPECT_EQ(versions[i].size(), snapshots[i].Size());
+  }
+  IntPersistentAVLTree::Snapshot current = tree.GetSnapshot();
+  EXPECT_EQ(expected, SnapshotContents(current));
+  for (int key = 0; key < 500; key++) {
+    std::map<int, int>::const_iterator it = expected.find(key);
+    if (it == expected.end()) {
+      EXPECT_TRUE(tree.Get(key) == NULL);
+    } else {
+      EXPECT_EQ(it->second, tree.Get(key)->Value());
+    }
+  }
+}
+
+TEST(PersistentAVLTreeTest, SnapshotOutlivesTree) {
+  IntPersistentAVLTree::Snapshot snapshot;
+  EXPECT_TRUE(snapshot.IsEmpty());
+  {
+    IntPersistentAVLTree tree;
+    for (int i = 0; i < 100; i++) {
+      tree.Add(i, i);
+    }
+    snapshot = tree.GetSnapshot();
+    tree.Remove(50);
+    tree.Add(7, 700);
+    EXPECT_EQ(700, tree.Get(7)->Value());
+  }
+  EXPECT_EQ(100U, snapshot.Size());
+  EXPECT_EQ(50, snapshot.Get(50)->Value());
+  EXPECT_EQ(7, snapshot.Get(7)->Value());
+  EXPECT_EQ(99, snapshot.GetLowerNearest(1000)->Key());
+}
+
+TEST(PersistentAVLTreeTest, SnapshotRangeUsesTreeOrder) {
+  PersistentAVLTree<CompareOnlyKey, int> tree;
+  for (int i = 0; i < 100; i++) {
+    tree.Add(CompareOnlyKey(i), i);
+  }
+  std::vector<int> keys;
+  tree.GetSnapshot().ForEachInRange(CompareOnlyKey(10), CompareOnlyKey(20),
+      [&keys](const PersistentAVLTree<CompareOnlyKey, int>::Comparable& item) {
+    keys.push_back(item.Key().n);
+  });
+  ASSERT_EQ(11U, keys.size());
+  EXPECT_EQ(10, keys.front());
+  EXPECT_EQ(20, keys.back());
+}
+
+TEST(PersistentAVLTreeTest, ReadSnapshotWhileWriting) {
+  IntPersistentAVLTree tree;
+  for (int i = 0; i < 1000; i++) {
+    tree.Add(i, i);
+  }
+  IntPersistentAVLTree::Snapshot snapshot = tree.GetSnapshot();
+  std::atomic<int> failures(0);
+  std::thread reader([&snapshot, &failures]() {
+    for (int round = 0; round < 20; round++) {
+      for (int i = 0; i < 1000; i++) {
+        const IntPersistentAVLTree::Comparable* item = snapshot.Get(i);
+        if (item == NULL || item->Value() != i) {
+          failures++;
+        }
+      }
+    }
+  });
+  for (int i = 0; i < 1000; i++) {
+    tree.Remove(i);
+    tree.Add(i + 1000, i);
+  }
+  reader.join();
+  EXPECT_EQ(0, failures.load());
+  EXPECT_TRUE(tree.Get(5) == NULL);
+}
+
+TEST(FrozenAVLTreeTest, MatchesLiveTree) {
+  for (int n = 0; n < 40; n++) {
+    IntAVLTree tree;
+    for (int i = 0; i < n; i++) {
+      tree.Add(i * 4, i);
+    }
+    FrozenAVLTree<int, int> frozen = Freeze(tree);
+    EXPECT_EQ(tree.Size(), frozen.Size());
+    for (int key = -2; key < n * 4 + 2; key++) {
+      EXPECT_EQ(tree.Get(key) == NULL, frozen.Get(key) == NULL);
+      if (tree.Get(key)) {
+        EXPECT_EQ(tree.Get(key)->Value(), frozen.Get(key)->Value());
+      }
+      const IntAVLTree::Comparable* live = tree.GetLowerNearest(key);
+      const FrozenAVLTree<int, int>::Comparable* nearest =
+          frozen.GetLowerNearest(key);
+      ASSERT_EQ(live == NULL, nearest == NULL) << "n " << n << " key " << key;
+      if (live) {
+        EXPECT_EQ(live->Key(), nearest->Key());
+      }
+    }
+  }
+}
+
+TEST(FrozenAVLTreeTest, ForEachInRange) {
+  RankedAVLTree tree;
+  for (int i = 0; i < 1000; i++) {
+    tree.Add(i * 2, i);
+  }
+  FrozenAVLTree<int, int> frozen(tree);
+  std::vector<int> keys;
+  frozen.ForEachInRange(-10, 5000,
+                        [&keys](const FrozenAVLTree<int, int>::Comparable& c) {
+    keys.push_back(c.Key());
+  });
+  ASSERT_EQ(1000U, keys.size());
+  for (int i = 0; i < 1000; i++) {
+    EXPECT_EQ(i * 2, keys[i]);
+  }
+  keys.clear();
+  frozen.ForEachInRange(101, 111,
+                        [&keys](const FrozenAVLTree<int, int>::Comparable& c) {
+    keys.push_back(c.Key());
+  });
+  EXPECT_EQ(5U, keys.size());
+  EXPECT_EQ(102, keys.front());
+  EXPECT_EQ(110, keys.back());
+}
+
+template <class KeyType> static void ExpectBlockedMatchesLiveTree() {
+  typedef FrozenBlockedAVLTree<KeyType, int> Blocked;
+  const KeyType kMax = std::numeric_limits<KeyType>::max();
+  const KeyType kMin = std::numeric_limits<KeyType>::min();
+  for (int isa = Blocked::kScalar; isa <= Blocked::kAVX2; isa++) {
+    for (int n = 0; n < 300; n += (n < 40 ? 1 : 37)) {
+      AVLTree<KeyType, int> tree;
+      for (int i = 0; i < n; i++) {
+        tree.Add(static_cast<KeyType>(i) * 3 - 50, i);
+      }
+      if (n % 2) {
+        tree.Add(kMax, -1);
+        tree.Add(kMin, -2);
+      }
+      Blocked blocked(tree, static_cast<typename Blocked::Isa>(isa));
+      EXPECT_LE(blocked.GetIsa(), isa);
+      EXPECT_EQ(tree.Size(), blocked.Size());
+      std::vector<KeyType> probes;
+      for (KeyType key = -53; key < n * 3 - 47; key++) {
+        probes.push_back(key);
+      }
+      probes.push_back(kMax);
+      probes.push_back(kMax - 1);
+      probes.push_back(kMin);
+      probes.push_back(kMin + 1);
+      for (size_t i = 0; i < probes.size(); i++) {
+        KeyType key = probes[i];
+        const typename AVLTree<KeyType, int>::Comparable* live = tree.Get(key);
+        const typename Blocked::Comparable* found = blocked.Get(key);
+        ASSERT_EQ(live == NULL, found == NULL) << "n " << n << " key " << key;
+        if (live) {
+          EXPECT_EQ(live->Value(), found->Value());
+        }
+        live = tree.GetLowerNearest(key);
+        found = blocked.GetLowerNearest(key);
+        ASSERT_EQ(live == NULL, found == NULL) << "n " << n << " key " << key;
+        if (live) {
+          EXPECT_EQ(live->Key(), found->Key());
+        }
+      }
+    }
+  }
+}
+
+TEST(FrozenBlockedAVLTreeTest, MatchesLiveTree32) {
+  ExpectBlockedMatchesLiveTree<int32_t>();
+}
+
+TEST(FrozenBlockedAVLTreeTest, MatchesLiveTree64) {
+  ExpectBlockedMatchesLiveTree<int64_t>();
+}
+
+TEST(FrozenBlockedAVLTreeTest, FreezeBlockedUsesDetectedIsa) {
+  IntAVLTree tree;
+  tree.Add(1, 10);
+  typedef FrozenBlockedAVLTree<int, int> Blocked;
+  Blocked blocked = FreezeBlocked(tree);
+  EXPECT_EQ(Blocked::DetectIsa(), blocked.GetIsa());
+  EXPECT_EQ(10, blocked.Get(1)->Value());
+  EXPECT_TRUE(blocked.Get(2) == NULL);
+}
+
+TEST(AVLTreeMoveTest, MoveOnlyValues) {
+  AVLTree<std::string, std::unique_ptr<int> > tree;
+  std::pair<AVLTree<std::string, std::unique_ptr<int> >::Comparable*, bool>
+      result = tree.TryEmplace(std::string("one"), new int(1));
+  EXPECT_TRUE(result.second);
+  EXPECT_EQ(1, *result.first->Value());
+
+  std::unique_ptr<int> two(new int(2));
+  result = tree.InsertOrAssign(std::string("two"), std::move(two));
+  EXPECT_TRUE(result.second);
+  EXPECT_TRUE(two == NULL);
+
+  std::unique_ptr<int> one(new int(11));
+  result = tree.InsertOrAssign(std::string("one"), std::move(one));
+  EXPECT_FALSE(result.second);
+  EXPECT_EQ(11, *tree.Get("one")->Value());
+
+  EXPECT_EQ(2U, tree.Size());
+  EXPECT_TRUE(tree.Remove("two"));
+  EXPECT_EQ(1U, tree.Size());
+}
+
+TEST(AVLTreeMoveTest, TryEmplaceLeavesArgumentsAloneOnHit) {
+  AVLTree<std::string, std::string> tree;
+  tree.Add("key", "old");
+  std::string key("key");
+  std::string value("a value long enough to live on the heap");
+  std::pair<AVLTree<std::string, std::string>::Comparable*, bool> result =
+      tree.TryEmplace(std::move(key), std::move(value));
+  EXPECT_FALSE(result.second);
+  EXPECT_EQ("old", result.first->Value());
+  EXPECT_EQ("key", key);
+  EXPECT_EQ("a value long enough to live on the heap", value);
+
+  result = tree.TryEmplace(std::string("other"), 3, 'x');
+  EXPECT_TRUE(result.second);
+  EXPECT_EQ("other", result.first->Key());
+  EXPECT_EQ("xxx", tree.Get("other")->Value());
+}
+
+TEST(AVLTreeMoveTest, EmplaceConvertsKey) {
+  AVLTree<std::string, int> tree;
+  EXPECT_TRUE(tree.Emplace("b", 2).second);
+  EXPECT_TRUE(tree.Emplace("a", 1).second);
+  std::pair<AVLTree<std::string, int>::Comparable*, bool> result =
+      tree.Emplace("b", 3);
+  EXPECT_FALSE(result.second);
+  EXPECT_EQ(2, result.first->Value());
+  EXPECT_EQ(2U, tree.Size());
+  EXPECT_EQ("a", tree.begin()->Key());
+  tree.Get("a")->Value() = 5;
+  EXPECT_EQ(5, tree.Get("a")->Value());
+}
+
+// Orders keys from largest to smallest and counts its calls.
+struct CountingReverseCompare {
+  int operator()(int lhs, int rhs) const {
+    calls++;
+    return (rhs < lhs) ? -1 : static_cast<int>(lhs < rhs);
+  }
+
+  static int calls;
+};
+
+int CountingReverseCompare::calls = 0;
+
+TEST(AVLTreeCompareTest, CustomComparatorOrdersKeys) {
+  typedef AVLTree<int, int, AVLPoolAllocator, AVLSubtreeSize,
+                  CountingReverseCompare> ReverseAVLTree;
+  ReverseAVLTree tree;
+  for (int i = 0; i < 100; i++) {
+    tree.Add(i * 2, i);
+  }
+  int expected = 198;
+  for (ReverseAVLTree::iterator it = tree.begin(); it != tree.end(); ++it) {
+    EXPECT_EQ(expected, it->Key());
+    expected -= 2;
+  }
+  EXPECT_EQ(0U, tree.Rank(198));
+  EXPECT_EQ(10U, tree.CountInRange(40, 22));
+  EXPECT_EQ(0U, tree.CountInRange(22, 40));
+  // The nearest key "below" 51 in this order is the next larger one.
+  EXPECT_EQ(52, tree.GetLowerNearest(51)->Key());
+  EXPECT_TRUE(tree.Remove(100));
+  EXPECT_TRUE(tree.Get(100) == NULL);
+  EXPECT_TRUE(tree.IsBalanced());
+
+  // One comparison per node visited.
+  CountingReverseCompare::calls = 0;
+  ReverseAVLTree::Node* n = tree.Root();
+  int depth = 0;
+  while (n->Key() != 0) {
+    n = n->children[(0 < n->Key()) ? ReverseAVLTree::kRight
+                                   : ReverseAVLTree::kLeft];
+    depth++;
+  }
+  EXPECT_EQ(0, tree.Get(0)->Value());
+  EXPECT_EQ(depth + 1, CountingReverseCompare::calls);
+}
+
+TEST(AVLTreeCompareTest, TransparentLookup) {
+  AVLTree<std::string, int> tree;
+  tree.Add("apple", 1);
+  tree.Add("banana", 2);
+  tree.Add("cherry", 3);
+  std::string_view banana("banana split", 6);
+  ASSERT_TRUE(tree.Get(banana) != NULL);
+  EXPECT_EQ(2, tree.Get(banana)->Value());
+  EXPECT_TRUE(tree.Get(std::string_view("blueberry")) == NULL);
+  EXPECT_EQ("banana", tree.GetLowerNearest(std::string_view("c"))->Key());
+  EXPECT_EQ("cherry", tree.lower_bound("c")->Key());
+  EXPECT_EQ("cherry", tree.upper_bound(banana)->Key());
+  EXPECT_TRUE(tree.equal_range("date").first == tree.end());
+}
+
+// Tagged with the pid so that test runs at the same time use different
+// files.
+static std::string TempPath(const char* name) {
+  return testing::TempDir() + std::to_string(getpid()) + "_" + name;
+}
+
+TEST(AVLTreeFileTest, SaveAndLoadRecords) {
+  std::string path = TempPath("avl_tree_records.img");
+  for (int n = 0; n < 300; n += 37) {
+    RankedAVLTree tree;
+    for (int i = 0; i < n; i++) {
+      tree.Add(i * 3, -i);
+    }
+    ASSERT_TRUE(SaveAVLTree(tree, path.c_str()));
+
+    RankedAVLTree loaded;
+    loaded.Add(1, 1);
+    ASSERT_TRUE(LoadAVLTree(path.c_str(), &loaded));
+    EXPECT_EQ(tree.Size(), loaded.Size());
+    EXPECT_TRUE(loaded.IsBalanced());
+    for (int i = 0; i < n; i++) {
+      ASSERT_TRUE(loaded.Get(i * 3) != NULL);
+      EXPECT_EQ(-i, loaded.Get(i * 3)->Value());
+      EXPECT_EQ(static_cast<size_t>(i), loaded.Rank(i * 3));
+    }
+
+    MappedAVLTree<int, int> mapped;
+    ASSERT_TRUE(mapped.Open(path.c_str()));
+    EXPECT_EQ(tree.Size(), mapped.Size());
+    for (int key = -2; key < n * 3 + 2; key++) {
+      const RankedAVLTree::Comparable* live = tree.Get(key);
+      const MappedAVLTree<int, int>::Record* found = mapped.Get(key);
+      ASSERT_EQ(live == NULL, found == NULL) << key;
+      if (live) {
+        EXPECT_EQ(live->Value(), found->Value());
+      }
+      live = tree.GetLowerNearest(key);
+      found = mapped.GetLowerNearest(key);
+      ASSERT_EQ(live == NULL, found == NULL) << key;
+      if (live) {
+        EXPECT_EQ(live->Key(), found->Key());
+      }
+    }
+  }
+  remove(path.c_str());
+}
+
+TEST(AVLTreeFileTest, SaveAndLoadStrings) {
+  std::string path = TempPath("avl_tree_strings.img");
+  AVLTree<std::string, std::string> tree;
+  tree.Add("", "empty");
+  tree.Add("apple", "");
+  tree.Add("banana", std::string(1000, 'b'));
+  ASSERT_TRUE(SaveAVLTree(tree, path.c_str()));
+  AVLTree<std::string, std::string> loaded;
+  ASSERT_TRUE(LoadAVLTree(path.c_str(), &loaded));
+  EXPECT_EQ(3U, loaded.Size());
+  EXPECT_EQ("empty", loaded.Get("")->Value());
+  EXPECT_EQ("", loaded.Get("apple")->Value());
+  EXPECT_EQ(std::string(1000, 'b'), loaded.Get("banana")->Value());
+
+  // Variable-size items cannot be mapped, and other types do not match.
+  MappedAVLTree<int, int> mapped;
+  EXPECT_FALSE(mapped.Open(path.c_str()));
+  IntAVLTree ints;
+  EXPECT_FALSE(LoadAVLTree(path.c_str(), &ints));
+  remove(path.c_str());
+}
+
+TEST(AVLTreeFileTest, RejectsDamagedFiles) {
+  std::string path = TempPath("avl_tree_damaged.img");
+  IntAVLTree tree;
+  for (int i = 0; i < 100; i++) {
+    tree.Add(i, i);
+  }
+  ASSERT_TRUE(SaveAVLTree(tree, path.c_str()));
+  FILE* file = fopen(path.c_str(), "r+b");
+  ASSERT_TRUE(file != NULL);
+  fseek(file, sizeof(AVLFileHeader) + 17, SEEK_SET);
+  fputc(0x55, file);
+  fclose(file);
+
+  IntAVLTree loaded;
+  loaded.Add(7, 7);
+  EXPECT_FALSE(LoadAVLTree(path.c_str(), &loaded));
+  EXPECT_EQ(1U, loaded.Size());
+  MappedAVLTree<int, int> mapped;
+  EXPECT_FALSE(mapped.Open(path.c_str()));
+  EXPECT_TRUE(mapped.Open(path.c_str(), false));
+
+  ASSERT_EQ(0, truncate(path.c_str(), sizeof(AVLFileHeader) + 10));
+  EXPECT_FALSE(LoadAVLTree(path.c_str(), &loaded));
+  EXPECT_FALSE(mapped.Open(path.c_str(), false));
+  remove(path.c_str());
+  EXPECT_FALSE(LoadAVLTree(path.c_str(), &loaded));
+  EXPECT_FALSE(mapped.Open(path.c_str()));
+}
+
+// Removes the files a DurableAVLTree keeps in dir, and dir itself.
+static void RemoveStore(const std::string& dir) {
+  remove((dir + "/checkpoint.img").c_str());
+  remove((dir + "/wal.log").c_str());
+  rmdir(dir.c_str());
+}
+
+TEST(DurableAVLTreeTest, RecoversFromCheckpointAndLog) {
+  std::string dir = TempPath("durable_avl_tree_recover");
+  RemoveStore(dir);
+  DurableAVLTree<int, std::string>::Options options;
+  options.checkpoint_bytes = 1024;
+  {
+    DurableAVLTree<int, std::string> store;
+    ASSERT_TRUE(store.Open(dir, options));
+    for (int i = 0; i < 200; i++) {
+      ASSERT_TRUE(store.Add(i, std::to_string(i)));
+    }
+    for (int i = 0; i < 200; i += 3) {
+      ASSERT_TRUE(store.Remove(i));
+    }
+    EXPECT_FALSE(store.Remove(0));
+    ASSERT_TRUE(store.Add(1, "one"));
+  }
+  DurableAVLTree<int, std::string> store;
+  ASSERT_TRUE(store.Open(dir, options));
+  EXPECT_EQ(133U, store.Size());
+  std::string value;
+  EXPECT_FALSE(store.Get(0, &value));
+  ASSERT_TRUE(store.Get(1, &value));
+  EXPECT_EQ("one", value);
+  ASSERT_TRUE(store.Get(199, &value));
+  EXPECT_EQ("199", value);
+  store.Close();
+
+  // A log written for other types is not replayed over.
+  DurableAVLTree<std::string, int> other;
+  EXPECT_FALSE(other.Open(dir));
+  RemoveStore(dir);
+}
+
+TEST(DurableAVLTreeTest, IgnoresTornRecords) {
+  std::string dir = TempPath("durable_avl_tree_torn");
+  RemoveStore(dir);
+  DurableAVLTree<int, int>::Options options;
+  options.sync = false;
+  options.checkpoint_bytes = 0;
+  {
+    DurableAVLTree<int, int> store;
+    ASSERT_TRUE(store.Open(dir, options));
+    for (int i = 0; i < 100; i++) {
+      store.Add(i, i);
+    }
+    ASSERT_TRUE(store.Sync());
+  }
+  FILE* file = fopen((dir + "/wal.log").c_str(), "ab");
+  ASSERT_TRUE(file != NULL);
+  fputs("half a record", file);
+  fclose(file);
+  {
+    DurableAVLTree<int, int> store;
+    ASSERT_TRUE(store.Open(dir, options));
+    EXPECT_EQ(100U, store.Size());
+    store.Add(100, 100);
+  }
+  DurableAVLTree<int, int> store;
+  ASSERT_TRUE(store.Open(dir, options));
+  EXPECT_EQ(101U, store.Size());
+  RemoveStore(dir);
+}
+
+TEST(DurableAVLTreeTest, GroupCommitsConcurrentWriters) {
+  std::string dir = TempPath("durable_avl_tree_group");
+  RemoveStore(dir);
+  {
+    DurableAVLTree<int, int> store;
+    ASSERT_TRUE(store.Open(dir));
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; t++) {
+      threads.push_back(std::thread([&store, t]() {
+        for (int i = 0; i < 50; i++) {
+          store.Add(t * 1000 + i, i);
+        }
+      }));
+    }
+    for (size_t t = 0; t < threads.size(); t++) {
+      threads[t].join();
+    }
+    EXPECT_EQ(400U, store.Size());
+  }
+  DurableAVLTree<int, int> store;
+  ASSERT_TRUE(store.Open(dir));
+  EXPECT_EQ(400U, store.Size());
+  RemoveStore(dir);
+}
+
+// Operation i of the crash test: every fourth one removes an earlier key.
+static void ApplyCrashTestOp(int i, std::map<int, int>* state) {
+  if (i % 4 == 3) {
+    state->erase(i - 2);
+  } else {
+    (*state)[i] = i * 7;
+  }
+}
+
+// A child process runs operations and reports each one that returned,
+// and is killed at a random point. Recovery must give the state after
+// every reported operation, plus at most the one in flight.
+TEST(DurableAVLTreeTest, SurvivesKillMidWrite) {
+  std::mt19937 rng(7);
+  for (int round = 0; round < 6; round++) {
+    std::string dir = TempPath("durable_avl_tree_crash");
+    RemoveStore(dir);
+    int acks[2];
+    ASSERT_EQ(0, pipe(acks));
+    pid_t child = fork();
+    ASSERT_GE(child, 0);
+    if (child == 0) {
+      close(acks[0]);
+      DurableAVLTree<int, int>::Options options;
+      options.checkpoint_bytes = 4096;
+      DurableAVLTree<int, int> store;
+      if (!store.Open(dir, options)) {
+        _exit(1);
+      }
+      for (int i = 0;; i++) {
+        bool ok = (i % 4 == 3) ? store.Remove(i - 2) : store.Add(i, i * 7);
+        if (!ok || write(acks[1], &i, sizeof(i)) != sizeof(i)) {
+          _exit(1);
+        }
+      }
+    }
+    close(acks[1]);
+    int target = 100 + static_cast<int>(rng() % 1500);
+    int acked = -1;
+    int op;
+    while (acked < target && read(acks[0], &op, sizeof(op)) == sizeof(op)) {
+      acked = op;
+    }
+    kill(child, SIGKILL);
+    waitpid(child, NULL, 0);
+    while (read(acks[0], &op, sizeof(op)) == sizeof(op)) {
+      acked = op;
+    }
+    close(acks[0]);
+    ASSERT_GE(acked, target);
+
+    std::map<int, int> expected;
+    for (int i = 0; i <= acked; i++) {
+      ApplyCrashTestOp(i, &expected);
+    }
+    std::map<int, int> in_flight(expected);
+    ApplyCrashTestOp(acked + 1, &in_flight);
+
+    DurableAVLTree<int, int> store;
+    ASSERT_TRUE(store.Open(dir));
+    const std::map<int, int>& match =
+        (store.Size() == expected.size()) ? expected : in_flight;
+    ASSERT_EQ(match.size(), store.Size()) << "round " << round;
+    for (std::map<int, int>::const_iterator it = match.begin();
+         it != match.end(); ++it) {
+      int value;
+      ASSERT_TRUE(store.Get(it->first, &value)) << it->first;
+      EXPECT_EQ(it->second, value);
+    }
+    store.Close();
+    RemoveStore(dir);
+  }
+}
+
+// Checks the order, balance factors and height of the subtree at n.
+static void ExpectJoinedTree(Node* n, int height, int lo, int hi) {
+  EXPECT_EQ(CheckedHeight(n), height);
+  EXPECT_EQ(Node::Height(n), height);
+  std::vector<int> keys;
+  IntAVLTree::Iterator end;
+  for (IntAVLTree::Iterator it = IntAVLTree::Iterator::Bound(n, lo, false);
+       it != end; ++it) {
+    keys.push_back(it->Key());
+  }
+  ASSERT_EQ(static_cast<size_t>(hi - lo), keys.size());
+  for (int i = lo; i < hi; i++) {
+    EXPECT_EQ(i, keys[i - lo]);
+  }
+}
+
+TEST(AVLTreeJoinTest, JoinAndSplit) {
+  IntAVLTree::NodeAllocator pool;
+  // Trees of very different heights on either side of the pivot.
+  const int kSizes[] = {0, 1, 2, 5, 100, 1000};
+  for (int left_size : kSizes) {
+    for (int right_size : kSizes) {
+      Node* left = NULL;
+      Node* right = NULL;
+      for (int i = 0; i < left_size; i++) {
+        Node::Insert(i, i, left, pool);
+      }
+      for (int i = left_size + 1; i <= left_size + right_size; i++) {
+        Node::Insert(i, i, right, pool);
+      }
+      Node* pivot = new(pool.Allocate()) Node(left_size, left_size);
+      int height;
+      Node* root = Node::Join(left, Node::Height(left), pivot, right,
+                              Node::Height(right), &height);
+      int total = left_size + right_size + 1;
+      ExpectJoinedTree(root, height, 0, total);
+
+      for (int key = -1; key <= total; key += 7) {
+        Node* below;
+        Node* found;
+        Node* above;
+        int below_height;
+        int above_height;
+        Node::Split(root, height, key, &below, &below_height, &found,
+                    &above, &above_height);
+        int split = std::min(std::max(key, 0), total);
+        ExpectJoinedTree(below, below_height, 0, split);
+        bool present = key >= 0 && key < total;
+        ExpectJoinedTree(above, above_height, split + present, total);
+        ASSERT_EQ(present, found != NULL);
+        root = found ? Node::Join(below, below_height, found, above,
+                                  above_height, &height)
+            : Node::Join(below, below_height, above, above_height, &height);
+        ExpectJoinedTree(root, height, 0, total);
+      }
+      Node::DestroyTree(root, pool);
+    }
+  }
+}
+
+enum SetOperation {
+  kUnion,
+  kIntersection,
+  kDifference
+};
+
+// Runs op on trees of the keys in a and b, with a's values odd and b's
+// even, and checks the result against std::set_* on the same keys.
+static void ExpectSetOperation(const std::vector<int>& a,
+                               const std::vector<int>& b, size_t threads,
+                               SetOperation op) {
+  IntAVLTree tree;
+  IntAVLTree other;
+  std::set<int> set_a;
+  std::set<int> set_b;
+  for (size_t i = 0; i < a.size(); i++) {
+    tree.Add(a[i], 2 * a[i] + 1);
+    set_a.insert(a[i]);
+  }
+  for (size_t i = 0; i < b.size(); i++) {
+    other.Add(b[i], 2 * b[i]);
+    set_b.insert(b[i]);
+  }
+  std::vector<int> expected;
+  std::back_insert_iterator<std::vector<int> > out(expected);
+  switch (op) {
+    case kUnion:
+      tree.Union(&other, threads);
+      std::set_union(set_a.begin(), set_a.end(), set_b.begin(), set_b.end(),
+                     out);
+      break;
+    case kIntersection:
+      tree.Intersection(&other, threads);
+      std::set_intersection(set_a.begin(), set_a.end(), set_b.begin(),
+                            set_b.end(), out);
+      break;
+    case kDifference:
+      tree.Difference(&other, threads);
+      std::set_difference(set_a.begin(), set_a.end(), set_b.begin(),
+                          set_b.end(), out);
+      break;
+  }
+  EXPECT_TRUE(other.IsEmpty());
+  EXPECT_EQ(0U, other.Size());
+  ASSERT_EQ(expected.size(), tree.Size());
+  CheckedHeight(tree.Root());
+  size_t i = 0;
+  for (IntAVLTree::iterator it = tree.begin(); it != tree.end(); ++it, ++i) {
+    ASSERT_EQ(expected[i], it->Key());
+    // Items in both trees keep this tree's value.
+    int value = set_a.count(it->Key()) ? 2 * it->Key() + 1 : 2 * it->Key();
+    EXPECT_EQ(value, it->Value());
+  }
+  // The nodes taken from other belong to tree now, freed ones included.
+  tree.Add(-1, -1);
+  other.Add(-1, -1);
+  EXPECT_EQ(-1, tree.Get(-1)->Value());
+}
+
+TEST(AVLTreeJoinTest, SetOperationsMatchStdSet) {
+  std::mt19937 rng(7);
+  const size_t kSizes[] = {0, 1, 30, 3000, 20000};
+  const size_t kThreads[] = {1, 4};
+  for (size_t threads : kThreads) {
+    for (size_t n : kSizes) {
+      for (size_t m : kSizes) {
+        std::uniform_int_distribution<int> keys(0, 2 * (n + m) + 1);
+        std::vector<int> a;
+        std::vector<int> b;
+        for (size_t i = 0; i < n; i++) {
+          a.push_back(keys(rng));
+        }
+        for (size_t i = 0; i < m; i++) {
+          b.push_back(keys(rng));
+        }
+        SCOPED_TRACE(testing::Message() << n << " " << m << " " << threads);
+        ExpectSetOperation(a, b, threads, kUnion);
+        ExpectSetOperation(a, b, threads, kIntersection);
+        ExpectSetOperation(a, b, threads, kDifference);
+      }
+    }
+  }
+}
+
+TEST(AVLTreeJoinTest, UnionKeepsSubtreeSizes) {
+  RankedAVLTree tree;
+  RankedAVLTree other;
+  for (int i = 0; i < 1000; i++) {
+    tree.Add(3 * i, i);
+    other.Add(2 * i, i);
+  }
+  tree.Union(&other, 2);
+  EXPECT_EQ(tree.Size(), CheckedSize(tree.Root()));
+  EXPECT_EQ(1000U + 666U, tree.Rank(3000));
+}
+
+typedef ShardedAVLTree<int, int> IntShardedAVLTree;
+typedef ShardedAVLTree<int, int, AVLRangePartitioner<int> >
+    IntRangeShardedAVLTree;
+
+// Applies random adds and removes to tree and checks every lookup, the
+// ordered walks and a batch insert against a std::map.
+template <class Tree>
+static void ExpectShardedMatchesMap(Tree* tree) {
+  std::map<int, int> expected;
+  srand(5);
+  for (int i = 0; i < 5000; i++) {
+    int key = rand() % 1000; // NOLINT
+    if (rand() % 3) { // NOLINT
+      tree->Add(key, i);
+      expected[key] = i;
+    } else {
+      EXPECT_EQ(expected.erase(key) == 1, tree->Remove(key));
+    }
+  }
+  std::vector<std::pair<int, int> > batch;
+  for (int i = 0; i < 3000; i++) {
+    batch.push_back(std::make_pair(rand() % 2000, -i)); // NOLINT
+    expected[batch.back().first] = -i;
+  }
+  // Later items in the batch win, as they would with Add().
+  tree->AddBatch(batch.begin(), batch.end(), 3);
+  EXPECT_EQ(expected.size(), tree->Size());
+  for (int key = 0; key < 2000; key++) {
+    int value = 1;
+    std::map<int, int>::const_iterator it = expected.find(key);
+    ASSERT_EQ(it != expected.end(), tree->Get(key, &value));
+    if (it != expected.end()) {
+      EXPECT_EQ(it->second, value);
+    }
+  }
+
+  std::vector<std::pair<int, int> > items;
+  tree->ForEach([&items](const typename Tree::Comparable& item) {
+    items.push_back(std::make_pair(item.Key(), item.Value()));
+  });
+  std::vector<std::pair<int, int> > expected_items(expected.begin(),
+                                                   expected.end());
+  EXPECT_EQ(expected_items, items);
+  std::vector<int> keys;
+  tree->ForEachInRange(100, 1200, [&keys](
+      const typename Tree::Comparable& item) {
+    keys.push_back(item.Key());
+  });
+  std::vector<int> expected_keys;
+  for (std::map<int, int>::const_iterator it = expected.lower_bound(100);
+       it != expected.end() && it->first <= 1200; ++it) {
+    expected_keys.push_back(it->first);
+  }
+  EXPECT_EQ(expected_keys, keys);
+}
+
+TEST(ShardedAVLTreeTest, HashPartitionMatchesMap) {
+  IntShardedAVLTree tree(8);
+  EXPECT_EQ(8U, tree.ShardCount());
+  ExpectShardedMatchesMap(&tree);
+}
+
+TEST(ShardedAVLTreeTest, RangePartitionMatchesMap) {
+  std::vector<int> bounds;
+  for (int i = 1; i < 8; i++) {
+    bounds.push_back(i * 250);
+  }
+  IntRangeShardedAVLTree tree(8, AVLRangePartitioner<int>(bounds));
+  ExpectShardedMatchesMap(&tree);
+}
+
+// Walks an inverted range, which must visit nothing.
+template <class Tree>
+static void ExpectInvertedRangeIsEmpty(Tree* tree) {
+  tree->Add(1, 1);
+  tree->Add(5, 5);
+  tree->Add(9, 9);
+  int calls = 0;
+  tree->ForEachInRange(6, 4, [&calls](const typename Tree::Comparable&) {
+    calls++;
+  });
+  EXPECT_EQ(0, calls);
+}
+
+TEST(ShardedAVLTreeTest, InvertedRangeIsEmpty) {
+  IntShardedAVLTree hashed(4);
+  ExpectInvertedRangeIsEmpty(&hashed);
+  std::vector<int> bounds;
+  bounds.push_back(4);
+  bounds.push_back(8);
+  IntRangeShardedAVLTree ranged(3, AVLRangePartitioner<int>(bounds));
+  ExpectInvertedRangeIsEmpty(&ranged);
+}
+
+TEST(ShardedAVLTreeTest, ConcurrentWriters) {
+  IntShardedAVLTree tree(16);
+  const int kThreads = 8;
+  const int kKeysPerThread = 5000;
+  std::vector<std::thread> writers;
+  for (int t = 0; t < kThreads; t++) {
+    writers.push_back(std::thread([&tree, t]() {
+      for (int i = 0; i < kKeysPerThread; i++) {
+        tree.Add(i * kThreads + t, t);
+      }
+      for (int i = 0; i < kKeysPerThread; i += 2) {
+        tree.Remove(i * kThreads + t);
+      }
+    }));
+  }
+  for (size_t t = 0; t < writers.size(); t++) {
+    writers[t].join();
+  }
+  EXPECT_EQ(static_cast<size_t>(kThreads * kKeysPerThread / 2),
+            tree.Size());
+  int value;
+  EXPECT_TRUE(tree.Get(kThreads + 3, &value));
+  EXPECT_EQ(3, value);
+  EXPECT_FALSE(tree.Get(3, &value));
+}
+
+typedef AVLTree<int, int, AVLPoolAllocator, AVLNoSubtreeSize,
+                AVLDefaultCompare, AVLOperationStats> StatsAVLTree;
+
+TEST(AVLTreeStatsTest, CountsOperations) {
+  StatsAVLTree tree;
+  // Ascending keys rotate once at 3, 5, 6 and 7.
+  for (int i = 1; i <= 7; i++) {
+    tree.Add(i, i);
+  }
+  AVLStats stats = tree.Stats();
+  EXPECT_EQ(4U, stats.single_rotations);
+  EXPECT_EQ(0U, stats.double_rotations);
+  EXPECT_EQ(7U, stats.allocations);
+  EXPECT_EQ(3, stats.height);
+  EXPECT_EQ(7U, stats.size);
+
+  tree.ResetStats();
+  // 4 is at the root of the perfect tree; 7 is two levels below it.
+  EXPECT_TRUE(tree.Get(4) != NULL);
+  EXPECT_TRUE(tree.Get(7) != NULL);
+  stats = tree.Stats();
+  EXPECT_EQ(4U, stats.comparisons);
+  EXPECT_EQ(4U, stats.nodes_visited);
+  EXPECT_EQ(0U, stats.allocations);
+
+  tree.ResetStats();
+  // 8 lands left of 9, right of 7: a right-left case.
+  tree.Add(9, 9);
+  tree.Add(8, 8);
+  stats = tree.Stats();
+  EXPECT_EQ(0U, stats.single_rotations);
+  EXPECT_EQ(1U, stats.double_rotations);
+  EXPECT_EQ(2U, stats.allocations);
+  EXPECT_EQ(9U, stats.size);
+}
+
+TEST(AVLTreeStatsTest, TreesCountSeparately) {
+  StatsAVLTree a;
+  StatsAVLTree b;
+  for (int i = 0; i < 100; i++) {
+    a.Add(i, i);
+  }
+  EXPECT_EQ(0U, b.Stats().comparisons);
+  EXPECT_EQ(100U, a.Stats().allocations);
+  // Other tree types share the node code but count nothing.
+  IntAVLTree plain;
+  plain.Add(1, 1);
+  EXPECT_EQ(100U, a.Stats().allocations);
+  FrozenAVLTree<int, int> frozen = Freeze(a);
+  EXPECT_EQ(100U, frozen.Size());
+}
+
+TEST(AVLTreeValidateTest, HeightFollowsWrites) {
+  IntAVLTree tree;
+  std::mt19937 rng(3);
+  for (int i = 0; i < 20000; i++) {
+    int key = static_cast<int>(rng() % 5000);
+    if (rng() % 3) {
+      tree.Add(key, key);
+    } else {
+      tree.Remove(key);
+    }
+    if (i % 97 == 0) {
+      ASSERT_EQ(CheckedHeight(tree.Root()), tree.Height());
+    }
+  }
+  EXPECT_TRUE(tree.Validate());
+  EXPECT_TRUE(tree.Validate(4));
+  IntAVLTree other;
+  for (int i = 0; i < 3000; i++) {
+    other.Add(i * 3, i);
+  }
+  tree.Union(&other);
+  EXPECT_EQ(CheckedHeight(tree.Root()), tree.Height());
+  EXPECT_EQ(0, other.Height());
+  tree.Clear();
+  EXPECT_EQ(0, tree.Height());
+  EXPECT_TRUE(tree.Validate());
+}
+
+TEST(AVLTreeValidateTest, FindsBrokenInvariants) {
+  RankedAVLTree tree;
+  for (int i = 0; i < 1000; i++) {
+    tree.Add(i, i);
+  }
+  ASSERT_TRUE(tree.Validate());
+  ASSERT_TRUE(tree.Validate(8));
+  // Deep in the tree, so only a full walk can see it.
+  RankedAVLTree::Node* n = tree.Root();
+  while (n->Left()->Left()) {
+    n = n->Left();
+  }
+  ASSERT_TRUE(n->Right() != NULL);
+  ASSERT_EQ(0, n->balance_factor);
+
+  n->balance_factor = 1;
+  EXPECT_FALSE(tree.Validate());
+  EXPECT_FALSE(tree.Validate(8));
+  n->balance_factor = 0;
+
+  std::swap(n->children[0], n->children[1]);
+  EXPECT_FALSE(tree.Validate());
+  EXPECT_FALSE(tree.Validate(8));
+  std::swap(n->children[0], n->children[1]);
+
+  n->SetSubtreeSize(n->SubtreeSize() + 1);
+  EXPECT_FALSE(tree.Validate());
+  n->Update();
+
+  // A cycle must not hang the walk.
+  RankedAVLTree::Node* leaf = n->children[0];
+  leaf->children[0] = tree.Root();
+  EXPECT_FALSE(tree.Validate());
+  leaf->children[0] = NULL;
+  EXPECT_TRUE(tree.Validate());
+
+  // A value changed behind the tree's back leaves its ancestors' sums
+  // stale.
+  typedef AVLTree<int, int, AVLPoolAllocator, AVLNoSubtreeSize,
+                  AVLDefaultCompare, AVLNoStats, AVLSum<int> > SumTree;
+  SumTree sums;
+  for (int i = 0; i < 1000; i++) {
+    sums.Add(i, i);
+  }
+  ASSERT_TRUE(sums.Validate());
+  ASSERT_TRUE(sums.Validate(8));
+  sums.Get(500)->Value() = -1;
+  EXPECT_FALSE(sums.Validate());
+  EXPECT_FALSE(sums.Validate(8));
+  sums.Get(500)->Value() = 500;
+  EXPECT_TRUE(sums.Validate());
+}
+
+// Applies random batches of adds and removes to tree and to a std::map
+// and checks that the two agree after each.
+template <class Tree>
+static void ExpectBatchesMatchMap(Tree* tree, size_t threads) {
+  std::mt19937 rng(11);
+  std::map<int, int> expected;
+  const size_t kBatchSizes[] = {0, 1, 7, 300, 10000};
+  for (size_t m : kBatchSizes) {
+    std::uniform_int_distribution<int> keys(0, 20000);
+    std::vector<std::pair<int, int> > adds;
+    std::vector<int> removes;
+    for (size_t i = 0; i < m; i++) {
+      adds.push_back(std::make_pair(keys(rng), static_cast<int>(i)));
+      removes.push_back(keys(rng));
+    }
+    // Every other batch is sorted and free of duplicates.
+    if (m % 2) {
+      std::sort(adds.begin(), adds.end());
+      adds.erase(std::unique(adds.begin(), adds.end(),
+                             [](const std::pair<int, int>& a,
+                                const std::pair<int, int>& b) {
+                               return a.first == b.first;
+                             }), adds.end());
+    }
+    tree->AddBatch(adds.begin(), adds.end(), threads);
+    for (size_t i = 0; i < adds.size(); i++) {
+      expected[adds[i].first] = adds[i].second;
+    }
+    ASSERT_TRUE(tree->Validate());
+    ASSERT_EQ(expected.size(), tree->Size());
+    tree->RemoveBatch(removes.begin(), removes.end(), threads);
+    for (size_t i = 0; i < removes.size(); i++) {
+      expected.erase(removes[i]);
+    }
+    ASSERT_TRUE(tree->Validate());
+    ASSERT_EQ(expected.size(), tree->Size());
+    EXPECT_EQ(CheckedHeight(tree->Root()), tree->Height());
+    std::map<int, int>::const_iterator want = expected.begin();
+    for (typename Tree::iterator it = tree->begin(); it != tree->end();
+         ++it, ++want) {
+      ASSERT_EQ(want->first, it->Key());
+      // The last of equal keys in a batch wins, as with an Add() loop.
+      ASSERT_EQ(want->second, it->Value());
+    }
+  }
+}
+
+TEST(AVLTreeBatchTest, MatchesMap) {
+  IntAVLTree tree;
+  ExpectBatchesMatchMap(&tree, 1);
+}
+
+TEST(AVLTreeBatchTest, MatchesMapOnThreads) {
+  IntAVLTree tree;
+  ExpectBatchesMatchMap(&tree, 4);
+  AVLTree<int, int, AVLHeapAllocator> heap_tree;
+  ExpectBatchesMatchMap(&heap_tree, 4);
+}
+
+TEST(AVLTreeBatchTest, KeepsSubtreeSizes) {
+  RankedAVLTree tree;
+  ExpectBatchesMatchMap(&tree, 2);
+  EXPECT_EQ(tree.Size(), CheckedSize(tree.Root()));
+}
+
+TEST(AVLTreeCursorTest, WalksInOrder) {
+  IntAVLTree tree;
+  IntAVLTree::Cursor empty(&tree);
+  EXPECT_FALSE(empty.Seek(1));
+  empty.Prev();
+  EXPECT_TRUE(empty.Current() == NULL);
+  for (int i = 0; i < 1000; i++) {
+    tree.Add(2 * i, i);
+  }
+  IntAVLTree::Cursor cursor(&tree);
+  EXPECT_TRUE(cursor.Current() == NULL);
+  cursor.Prev();
+  for (IntAVLTree::iterator it = --tree.end(); it != tree.begin(); --it) {
+    ASSERT_EQ(it->Key(), cursor.Current()->Key());
+    cursor.Prev();
+  }
+  EXPECT_EQ(0, cursor.Current()->Key());
+  for (IntAVLTree::iterator it = tree.begin(); it != tree.end(); ++it) {
+    ASSERT_EQ(it->Key(), cursor.Current()->Key());
+    cursor.Next();
+  }
+  EXPECT_TRUE(cursor.Current() == NULL);
+  EXPECT_FALSE(cursor.Seek(1001));
+  EXPECT_EQ(1002, cursor.Current()->Key());
+  cursor.Prev();
+  EXPECT_EQ(tree.GetLowerNearest(1001), cursor.Current());
+  EXPECT_TRUE(cursor.Seek(0));
+  EXPECT_FALSE(cursor.Seek(1999));
+  EXPECT_TRUE(cursor.Current() == NULL);
+}
+
+// Moves a cursor around tree in short random hops, seeking, adding and
+// removing as it goes, and checks every step against a std::map.
+template <class Tree>
+static void ExpectCursorMatchesMap(Tree* tree) {
+  std::mt19937 rng(5);
+  std::map<int, int> expected;
+  for (int i = 0; i < 2000; i += 3) {
+    tree->Add(i, i);
+    expected[i] = i;
+  }
+  typename Tree::Cursor cursor(tree);
+  int key = 1000;
+  for (int step = 0; step < 20000; step++) {
+    // Mostly nearby keys, now and then a jump across the tree.
+    key = (rng() % 16 == 0) ? static_cast<int>(rng() % 2000)
+        : std::max(0, key + static_cast<int>(rng() % 21) - 10);
+    std::map<int, int>::iterator want;
+    switch (rng() % 5) {
+      case 0:
+        ASSERT_EQ(expected.count(key) == 1, cursor.Seek(key));
+        want = expected.lower_bound(key);
+        break;
+      case 1:
+        ASSERT_EQ(expected.count(key) == 0, cursor.InsertHint(key, step));
+        expected[key] = step;
+        want = expected.find(key);
+        break;
+      case 2:
+        cursor.Seek(key);
+        want = expected.lower_bound(key);
+        if (want != expected.end()) {
+          expected.erase(want++);
+        }
+        cursor.EraseAt();
+        break;
+      case 3:
+        cursor.Seek(key);
+        want = expected.lower_bound(key);
+        if (want != expected.end()) {
+          ++want;
+        }
+        cursor.Next();
+        break;
+      default:
+        cursor.Seek(key);
+        want = expected.lower_bound(key);
+        if (want != expected.begin()) {
+          --want;
+          cursor.Prev();
+        }
+        break;
+    }
+    if (want == expected.end()) {
+      ASSERT_TRUE(cursor.Current() == NULL);
+    } else {
+      ASSERT_TRUE(cursor.Current() != NULL);
+      ASSERT_EQ(want->first, cursor.Current()->Key());
+      ASSERT_EQ(want->second, cursor.Current()->Value());
+    }
+    if (step % 1000 == 0) {
+      ASSERT_TRUE(tree->Validate());
+    }
+  }
+  ASSERT_TRUE(tree->Validate());
+  ASSERT_EQ(expected.size(), tree->Size());
+  EXPECT_EQ(CheckedHeight(tree->Root()), tree->Height());
+}
+
+TEST(AVLTreeCursorTest, MatchesMap) {
+  IntAVLTree tree;
+  ExpectCursorMatchesMap(&tree);
+}
+
+TEST(AVLTreeCursorTest, KeepsSubtreeSizes) {
+  RankedAVLTree tree;
+  ExpectCursorMatchesMap(&tree);
+  EXPECT_EQ(tree.Size(), CheckedSize(tree.Root()));
+}
+
+// Concatenation is associative but not commutative, so it catches
+// summaries combined out of key order.
+struct ConcatAggregate {
+  static const bool kEnabled = true;
+  typedef std::string Type;
+
+  static std::string Identity() {
+    return std::string();
+  }
+
+  static std::string Of(int value) {
+    return std::to_string(value) + ",";
+  }
+
+  static std::string Combine(const std::string& a, const std::string& b) {
+    return a + b;
+  }
+};
+
+// Writes to tree by every path that changes values or shape, and checks
+// Aggregate() over random ranges against folding a std::map with A.
+template <class A>
+static void ExpectAggregatesMatchMap() {
+  typedef AVLTree<int, int, AVLPoolAllocator, AVLSubtreeSize,
+                  AVLDefaultCompare, AVLNoStats, A> Tree;
+  std::mt19937 rng(3);
+  std::uniform_int_distribution<int> keys(0, 999);
+  Tree tree;
+  typename Tree::Cursor cursor(&tree);
+  std::map<int, int> expected;
+  for (int round = 0; round < 300; round++) {
+    int key = keys(rng);
+    int value = static_cast<int>(rng() % 1000) - 500;
+    switch (round % 6) {
+      case 0:
+      case 1:
+        tree.InsertOrAssign(key, value);
+        expected[key] = value;
+        break;
+      case 2:
+        tree.Remove(key);
+        expected.erase(key);
+        break;
+      case 3: {
+        std::vector<std::pair<int, int> > batch;
+        for (int i = 0; i < 20; i++) {
+          batch.push_back(std::make_pair(keys(rng), value + i));
+          expected[batch.back().first] = batch.back().second;
+        }
+        tree.AddBatch(batch.begin(), batch.end());
+        break;
+      }
+      case 4:
+        cursor.InsertHint(key, value);
+        expected[key] = value;
+        break;
+      default:
+        cursor.Seek(key);
+        cursor.EraseAt();
+        if (expected.lower_bound(key) != expected.end()) {
+          expected.erase(expected.lower_bound(key));
+        }
+        break;
+    }
+    for (int query = 0; query < 10; query++) {
+      int lo = keys(rng);
+      int hi = lo + static_cast<int>(rng() % 300);
+      typename A::Type want = A::Identity();
+      for (std::map<int, int>::iterator it = expected.lower_bound(lo);
+           it != expected.end() && it->first <= hi; ++it) {
+        want = A::Combine(want, A::Of(it->second));
+      }
+      ASSERT_EQ(want, tree.Aggregate(lo, hi)) << lo << " " << hi;
+    }
+  }
+  ASSERT_TRUE(tree.Validate());
+  EXPECT_EQ(A::Identity(), tree.Aggregate(10, 5));
+}
+
+TEST(AVLTreeAggregateTest, Sum) {
+  ExpectAggregatesMatchMap<AVLSum<int> >();
+}
+
+TEST(AVLTreeAggregateTest, MinAndMax) {
+  ExpectAggregatesMatchMap<AVLMin<int> >();
+  ExpectAggregatesMatchMap<AVLMax<int> >();
+}
+
+TEST(AVLTreeAggregateTest, KeepsKeyOrder) {
+  ExpectAggregatesMatchMap<ConcatAggregate>();
+}
+
+TEST(AVLTreeAggregateTest, SurvivesSetOperations) {
+  typedef AVLTree<int, int, AVLPoolAllocator, AVLNoSubtreeSize,
+                  AVLDefaultCompare, AVLNoStats, AVLSum<int> > SumTree;
+  SumTree tree;
+  SumTree other;
+  for (int i = 0; i < 3000; i++) {
+    tree.Add(2 * i, 1);
+    other.Add(3 * i, 10);
+  }
+  tree.Union(&other, 2);
+  // 0..5998: 3000 evens at 1, plus 1000 odd multiples of 3 at 10.
+  EXPECT_EQ(3000 + 10000, tree.Aggregate(0, 5998));
+  std::vector<int> evens;
+  for (int i = 0; i < 6000; i += 2) {
+    evens.push_back(i);
+  }
+  tree.RemoveBatch(evens.begin(), evens.end());
+  EXPECT_EQ(10000, tree.Aggregate(0, 5998));
+  EXPECT_EQ(10 * 1000, tree.Aggregate(6000, 8997));
+}
+
+typedef IntervalAVLTree<int, int> IntIntervalAVLTree;
+
+// Checks every query of tree against a scan of intervals, which holds
+// exactly the intervals in tree.
+static void ExpectIntervalsMatchScan(
+    const IntIntervalAVLTree& tree,
+    const std::set<std::pair<int, int> >& intervals, int lo, int hi) {
+  std::vector<std::pair<int, int> > expected;
+  size_t stabbed = 0;
+  for (std::set<std::pair<int, int> >::const_iterator it = intervals.begin();
+       it != intervals.end(); ++it) {
+    if (it->first <= hi && lo <= it->second) {
+      expected.push_back(*it);
+    }
+    if (it->first <= lo && lo <= it->second) {
+      stabbed++;
+    }
+  }
+  std::vector<std::pair<int, int> > found;
+  tree.Overlapping(lo, hi, [&found](const IntIntervalAVLTree::Comparable& c) {
+    found.push_back(c.Key());
+    EXPECT_EQ(c.Key().first + c.Key().second, c.Value());
+  });
+  ASSERT_EQ(expected, found);
+  size_t points = 0;
+  tree.Overlapping(lo, [&points](const IntIntervalAVLTree::Comparable&) {
+    points++;
+  });
+  EXPECT_EQ(stabbed, points);
+  EXPECT_EQ(stabbed, tree.CountStabbing(lo));
+}
+
+TEST(IntervalAVLTreeTest, MatchesScan) {
+  std::mt19937 rng(9);
+  std::uniform_int_distribution<int> starts(-500, 5000);
+  IntIntervalAVLTree tree;
+  std::set<std::pair<int, int> > intervals;
+  for (int round = 0; round < 4000; round++) {
+    int lo = starts(rng);
+    // Mostly short intervals, and a few that cover much of the range.
+    int hi = lo + static_cast<int>((round % 50 == 0) ? rng() % 3000
+                                                      : rng() % 40);
+    if (round % 3 == 2) {
+      std::set<std::pair<int, int> >::iterator victim =
+          intervals.lower_bound(std::make_pair(lo, lo));
+      if (victim != intervals.end()) {
+        ASSERT_TRUE(tree.Remove(victim->first, victim->second));
+        intervals.erase(victim);
+      }
+    } else {
+      tree.Add(lo, hi, lo + hi);
+      intervals.insert(std::make_pair(lo, hi));
+    }
+    if (round % 100 == 0) {
+      int point = starts(rng);
+      ExpectIntervalsMatchScan(tree, intervals, point,
+                               point + static_cast<int>(rng() % 100));
+    }
+  }
+  ASSERT_EQ(intervals.size(), tree.Size());
+  EXPECT_TRUE(tree.Intervals().Validate());
+  EXPECT_FALSE(tree.Remove(6000, 6001));
+  ExpectIntervalsMatchScan(tree, intervals, -1000, -600);
+  ExpectIntervalsMatchScan(tree, intervals, -1000, 10000);
+}
+
+TEST(IntervalAVLTreeTest, SameIntervalAssigns) {
+  IntIntervalAVLTree tree;
+  tree.Add(1, 5, 1);
+  tree.Add(1, 5, 2);
+  tree.Add(1, 1, 3);
+  EXPECT_EQ(2U, tree.Size());
+  EXPECT_EQ(2, tree.Get(1, 5)->Value());
+  EXPECT_EQ(2U, tree.CountStabbing(1));
+  EXPECT_EQ(1U, tree.CountStabbing(5));
+  EXPECT_EQ(0U, tree.CountStabbing(6));
+}
+
+typedef MultiAVLTree<int, int> IntMultiAVLTree;
+
+TEST(MultiAVLTreeTest, MatchesMultimap) {
+  std::mt19937 rng(21);
+  std::uniform_int_distribution<int> keys(0, 50);
+  IntMultiAVLTree tree;
+  std::multimap<int, int> expected;
+  for (int round = 0; round < 5000; round++) {
+    int key = keys(rng);
+    switch (rng() % 10) {
+      case 0: {
+        std::multimap<int, int>::iterator oldest = expected.lower_bound(key);
+        bool present = oldest != expected.end() && oldest->first == key;
+        ASSERT_EQ(present, tree.RemoveOne(key));
+        if (present) {
+          expected.erase(oldest);
+        }
+        break;
+      }
+      case 1:
+        ASSERT_EQ(expected.count(key), tree.RemoveAll(key));
+        expected.erase(key);
+        break;
+      default:
+        tree.Add(key, round);
+        expected.insert(std::make_pair(key, round));
+        break;
+    }
+    ASSERT_EQ(expected.count(key), tree.Count(key));
+    std::vector<int> want;
+    std::vector<int> got;
+    std::pair<std::multimap<int, int>::iterator,
+              std::multimap<int, int>::iterator> range =
+        expected.equal_range(key);
+    for (std::multimap<int, int>::iterator it = range.first;
+         it != range.second; ++it) {
+      want.push_back(it->second);
+    }
+    std::pair<IntMultiAVLTree::iterator, IntMultiAVLTree::iterator> items =
+        tree.EqualRange(key);
+    for (IntMultiAVLTree::iterator it = items.first; it != items.second;
+         ++it) {
+      EXPECT_EQ(key, it->Key().first);
+      got.push_back(it->Value());
+    }
+    ASSERT_EQ(want, got);
+  }
+  ASSERT_EQ(expected.size(), tree.Size());
+  EXPECT_TRUE(tree.Items().Validate());
+  EXPECT_EQ(0U, tree.Count(-1));
+  EXPECT_FALSE(tree.RemoveOne(51));
+  EXPECT_EQ(0U, tree.RemoveAll(51));
+}
+
+TEST(AVLPoolAllocatorTest, ReusesFreedSlots) {
+  AVLPoolAllocator<int64_t> pool;
+  void* a = pool.Allocate();
+  void* b = pool.Allocate();
+  EXPECT_NE(a, b);
+  pool.Free(a);
+  EXPECT_EQ(a, pool.Allocate());
+  pool.ReleaseAll();
+}
+
+TEST(AVLPoolAllocatorTest, GrowsAcrossChunks) {
+  AVLPoolAllocator<int64_t> pool;
+  const int kN = 10000;
+  for (int i = 0; i < kN; i++) {
+    int64_t* p = static_cast<int64_t*>(pool.Allocate());
+    *p = i;
+    EXPECT_EQ(0U, reinterpret_cast<uintptr_t>(p) % alignof(int64_t));
+  }
+}
+
+TEST(AVLTreeAllocatorTest, HeapAllocator) {
+  AVLTree<int, int, AVLHeapAllocator> tree;
+  for (int i = 0; i < 100; i++) {
+    tree.Add(i, i);
+  }
+  for (int i = 0; i < 100; i += 2) {
+    EXPECT_TRUE(tree.Remove(i));
+  }
+  EXPECT_FALSE(tree.Remove(0));
+  EXPECT_TRUE(tree.Get(0) == NULL);
+  EXPECT_EQ(51, tree.Get(51)->Value());
+  EXPECT_TRUE(tree.IsBalanced());
+}
+
+TEST(AVLTreeAllocatorTest, NonTrivialItems) {
+  AVLTree<std::string, std::string> tree;
+  tree.Add("b", "bee");
+  tree.Add("a", "ay");
+  tree.Add("c", "sea");
+  tree.Add("a", "aye");
+  EXPECT_EQ("aye", tree.Get("a")->Value());
+  EXPECT_TRUE(tree.Remove("b"));
+  EXPECT_TRUE(tree.Get("b") == NULL);
+  tree.Clear();
+  EXPECT_TRUE(tree.IsEmpty());
+  tree.Add("d", "dee");
+  EXPECT_EQ("dee", tree.Get("d")->Value());
+}
+
 }  // namespace
 
 int main(int argc, char **argv) {